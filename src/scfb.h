@@ -0,0 +1,330 @@
+/*
+ * Copyright © 2001-2012 Matthieu Herrb
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *    - Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    - Redistributions in binary form must reproduce the above
+ *      copyright notice, this list of conditions and the following
+ *      disclaimer in the documentation and/or other materials provided
+ *      with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ * ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/* Private definitions shared by the scfb driver sources. */
+
+#ifndef SCFB_H
+#define SCFB_H
+
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/consio.h>
+#include <X11/extensions/randr.h>
+
+#include "xf86.h"
+#include "shadow.h"
+#include "damage.h"
+#ifdef XFreeXDGA
+#include "dgaproc.h"
+#endif
+
+#include "compat-api.h"
+
+/* Output scale factor, 16.16 fixed point. */
+#define SCFB_SCALE_ONE		0x10000
+
+enum { SCFB_ROTATE_NONE = 0,
+       SCFB_ROTATE_CCW = 90,
+       SCFB_ROTATE_UD = 180,
+       SCFB_ROTATE_CW = 270
+};
+
+/*
+ * Maps framebuffer coordinates (u, v) to shadow coordinates:
+ *	x = xx * u + xy * v + x0
+ *	y = yx * u + yy * v + y0
+ * The matrix part is always a signed permutation.
+ */
+typedef struct {
+	int			xx, xy, x0;
+	int			yx, yy, y0;
+} ScfbXformRec, *ScfbXformPtr;
+
+/* Latency histogram in microseconds, buckets a quarter octave wide. */
+#define SCFB_LATENCY_BUCKETS	128
+
+typedef struct {
+	CARD32			bucket[SCFB_LATENCY_BUCKETS];
+	CARD32			count;
+	CARD32			max;
+} ScfbLatencyRec, *ScfbLatencyPtr;
+
+/* Runtime tunable knobs, see scfb_tune.c. */
+#define SCFB_TUNE_KNOBS		5
+#define SCFB_TUNE_VALUES	3
+
+/* Pixmap pool size classes, 256 bytes to 16 kB. */
+#define SCFB_POOL_CLASSES	7
+
+/* Ages of damage kept apart by the budgeted flush. */
+#define SCFB_SCHED_BANDS	4
+
+/* Private data */
+typedef struct {
+	int			fd; /* File descriptor of open device. */
+	Bool			fdOwned; /* fd is ours, not the console's. */
+	char *			devName; /* Device to map the framebuffer from. */
+	struct video_info	info;
+	int			linebytes; /* Number of bytes per row. */
+	unsigned char*		fbstart;
+	unsigned char*		fbmem;
+	size_t			fbmem_len;
+	int			rotate;
+	int			rrRotation; /* RandR rotation on top of rotate. */
+	Bool			shadowFB;
+	Bool			mirrorFB; /* Written through, no shadow. */
+	Bool			swizzle; /* Shadow is x8r8g8b8, the */
+	rgb			fbOffset; /* framebuffer has these offsets. */
+	int			packDepth; /* 1 or 4 bpp under an 8 bpp shadow. */
+	Bool			expand; /* 32 bpp under an r5g6b5 shadow. */
+	CARD8			packLut[256]; /* Pixel to 1 bpp, from the colormap. */
+	int			packThreshold; /* Where packLut splits, or -1, */
+	int			packInvert; /* and its value below that. */
+	Bool			gammaSoft; /* Gamma ramps applied in the flush, */
+	Bool			gamma; /* and not the identity right now. */
+	CARD8			gammaRamp[3][256];
+	CARD32			gammaLut[3 * 256]; /* By shadow pixel byte. */
+	DamagePtr		mirrorDamage;
+	void *			shadow;
+	int			shadowWidth; /* Screen pixmap size, */
+	int			shadowHeight; /* after RandR rotation. */
+	int			shadowPitch; /* Bytes per shadow row. */
+	ScfbXformRec		xform;
+	int			imgWidth; /* Shadow size in framebuffer */
+	int			imgHeight; /* orientation, before scaling. */
+	Bool			panning; /* Screen larger than the framebuffer. */
+	int			viewX; /* Viewport shown, in screen */
+	int			viewY; /* coordinates. */
+	int			viewWidth;
+	int			viewHeight;
+	int			panX; /* Viewport asked for by AdjustFrame. */
+	int			panY;
+	int			scale; /* Framebuffer pixels per shadow pixel. */
+	int			scaleInv;
+	CARD8 *			flushLine; /* Scratch lines. */
+	size_t			flushLineLen;
+	int			flushKernel; /* How rows reach the framebuffer, */
+	Bool			kernelPinned; /* unless pinned, timed. */
+	CloseScreenProcPtr	CloseScreen;
+	CreateScreenResourcesProcPtr CreateScreenResources;
+	CreateGCProcPtr		CreateGC;
+	CreatePixmapProcPtr	CreatePixmap;
+	DestroyPixmapProcPtr	DestroyPixmap;
+	CopyWindowProcPtr	CopyWindow;
+	void			(*PointerMoved)(SCRN_ARG_TYPE, int, int);
+	EntityInfoPtr		pEnt;
+	DamagePtr		shadowDamage; /* Not yet flushed. */
+	Bool			scrollInPlace; /* Framebuffer reads are cheap. */
+	Bool			bypassAllowed;
+	Bool			bypass; /* Screen pixmap is the framebuffer. */
+	Bool			dgaActive; /* A DGA client owns the framebuffer. */
+
+	/* Flush box coalescing, with its cost model in picoseconds */
+	Bool			coalesce;
+	CARD64			costBox;
+	CARD64			costRow;
+	CARD64			costByte;
+	BoxPtr			flushBoxes;
+	int			flushBoxesLen;
+	CARD64			statBoxesIn;
+	CARD64			statBoxesOut;
+	CARD64			statEstNs;
+	CARD64			statActualNs;
+	CARD64			statPixels;
+
+	/* Telling the kernel which rectangles changed */
+	Bool			dirtyNotify;
+	Bool			dirtyIoctl; /* Else only into the recording. */
+	CARD64			statDirtyCalls;
+	CARD64			statDirtyRects;
+
+	/* Damage to flush latency, times in ns */
+	Bool			latencyStats;
+	DamagePtr		latencyDamage;
+	CARD64			damageStart; /* First damage since a flush. */
+	CARD64			inputStart; /* First pointer motion since. */
+	CARD64			pendingDamageStart; /* Handed to the worker. */
+	CARD64			pendingInputStart;
+	ScfbLatencyRec		latDamage;
+	ScfbLatencyRec		latInput;
+	CARD32			latencyPublished; /* Server time, ms. */
+	CARD32			statsInterval; /* ms between publishing. */
+
+	/* Flush backoff for small, continuous damage, times in ms */
+	int			backoffMax; /* 0: flush at once. */
+	int			backoff;
+	OsTimerPtr		flushTimer;
+	Bool			flushTimerArmed;
+	RegionRec		flushDeferred;
+	CARD32			lastFlush;
+	Bool			inputSeen; /* Pointer moved since the flush. */
+	CARD32			statWakeups; /* Flushes begun by damage, */
+	CARD32			statTimerWakeups; /* and by the timer. */
+
+	/* Time budgeted flushing, pointer and focus first */
+	int			flushBudget; /* us per tick, 0: all at once. */
+	int			pointerX; /* Screen coordinates. */
+	int			pointerY;
+	RegionRec		schedBand[SCFB_SCHED_BANDS]; /* Oldest first, */
+	CARD32			schedTime[SCFB_SCHED_BANDS]; /* damaged then. */
+	int			schedBands;
+	OsTimerPtr		schedTimer;
+	Bool			schedTimerArmed;
+	CARD64			schedBytes; /* Left for the next tick. */
+	CARD64			statDeferredBytes; /* Summed over ticks. */
+	CARD32			statDeferredTicks;
+	CARD32			statStaleMax; /* Oldest damage flushed, ms. */
+	CARD32			schedPublished;
+
+	/* Flush worker */
+	Bool			flushThreaded;
+	int			flushCPU; /* -1: not pinned. */
+	Bool			flushRunning;
+	pthread_t		flushThread;
+	pthread_mutex_t		flushLock;
+	pthread_cond_t		flushCond;
+	pthread_cond_t		flushIdle;
+	RegionRec		flushPending;
+	Bool			flushBusy;
+	Bool			flushQuit;
+
+#ifdef XFreeXDGA
+	/* DGA info */
+	DGAModePtr		pDGAMode;
+	int			nDGAMode;
+#endif
+
+	/* Shared memory export */
+	const char *		exportName;
+	void *			exportMap;
+	size_t			exportLen;
+
+	/* Pool for small pixmaps, sizes in bytes */
+	size_t			poolMax; /* 0: no pool. */
+	size_t			poolBytes; /* In slabs, */
+	size_t			poolChunkBytes; /* handed out, */
+	size_t			poolUsedBytes; /* and asked for. */
+	struct _ScfbSlab *	poolSlabs[SCFB_POOL_CLASSES];
+	CARD64			statPoolAllocs;
+	CARD64			statPoolLarge; /* Left to fb for their size, */
+	CARD64			statPoolCapped; /* and for the cap. */
+	CARD32			poolPublished; /* Server time, ms. */
+
+	/* Damage and flush cost per client */
+	int			clientLog; /* Seconds between logs, -1: off. */
+	DamagePtr		clientDamage;
+	struct _ScfbClients *	clientCosts;
+
+	/* Runtime tuning */
+	Bool			tuning;
+	Atom			tuneAtom[SCFB_TUNE_KNOBS];
+	INT32			tuneValue[SCFB_TUNE_KNOBS][SCFB_TUNE_VALUES];
+	CARD32			tunePending; /* Knobs set, not yet applied, */
+	CARD32			tuneStale; /* and to be published again. */
+
+	/* Flush recording */
+	const char *		recordName;
+	int			recordFd; /* -1: not recording. */
+	Bool			recordPixels;
+	CARD64 *		recordHash; /* Per tile, as last recorded. */
+	int			recordTilesX;
+	int			recordTilesY;
+	CARD8 *			recordBuf;
+	size_t			recordBufLen;
+
+	OptionInfoPtr		Options;
+} ScfbRec, *ScfbPtr;
+
+#define SCFBPTR(p) ((ScfbPtr)((p)->driverPrivate))
+
+/* scfb_accel.c */
+extern Bool ScfbAccelInit(ScreenPtr pScreen);
+extern void ScfbAccelFini(ScreenPtr pScreen);
+
+/* scfb_driver.c */
+extern Bool ScfbSetRotation(ScrnInfoPtr pScrn, int rotation);
+
+/* scfb_client.c */
+extern Bool ScfbClientStart(ScreenPtr pScreen);
+extern void ScfbClientPublish(ScrnInfoPtr pScrn);
+extern void ScfbClientFini(ScrnInfoPtr pScrn);
+
+/* scfb_export.c */
+extern Bool ScfbExportInit(ScrnInfoPtr pScrn, size_t len);
+extern void ScfbExportGeometry(ScrnInfoPtr pScrn);
+extern void ScfbExportDamage(ScrnInfoPtr pScrn, RegionPtr pRegion);
+extern void ScfbExportFini(ScrnInfoPtr pScrn);
+
+/* scfb_record.c */
+extern Bool ScfbRecordInit(ScrnInfoPtr pScrn);
+extern void ScfbRecordGeometry(ScrnInfoPtr pScrn);
+extern void ScfbRecordLayout(ScrnInfoPtr pScrn);
+extern void ScfbRecordFlush(ScrnInfoPtr pScrn, RegionPtr pRegion);
+extern void ScfbRecordDirty(ScrnInfoPtr pScrn, const BoxRec *pbox, int nbox);
+extern void ScfbRecordFini(ScrnInfoPtr pScrn);
+
+/* scfb_pool.c */
+extern Bool ScfbPoolInit(ScreenPtr pScreen);
+extern void ScfbPoolPublish(ScrnInfoPtr pScrn);
+extern void ScfbPoolFini(ScrnInfoPtr pScrn);
+
+/* scfb_tune.c */
+extern void ScfbTuneInit(ScrnInfoPtr pScrn);
+extern void ScfbTuneApply(ScrnInfoPtr pScrn);
+extern void ScfbTuneFini(ScrnInfoPtr pScrn);
+
+/* scfb_flush.c */
+extern void ScfbBackoffStart(ScrnInfoPtr pScrn);
+extern void ScfbBackoffStop(ScrnInfoPtr pScrn);
+extern void ScfbBudgetStart(ScrnInfoPtr pScrn);
+extern void ScfbBudgetStop(ScrnInfoPtr pScrn);
+extern void ScfbBypassStop(ScrnInfoPtr pScrn);
+extern Bool ScfbFlushInit(ScrnInfoPtr pScrn);
+extern Bool ScfbFlushStart(ScrnInfoPtr pScrn);
+extern void ScfbFlushStop(ScrnInfoPtr pScrn);
+extern void ScfbFlushSync(ScrnInfoPtr pScrn);
+extern void ScfbFlushRegion(ScrnInfoPtr pScrn, RegionPtr pRegion);
+extern void ScfbFlushCalibrate(ScrnInfoPtr pScrn);
+extern int ScfbFlushKernelLookup(const char *name);
+extern void ScfbFlushAutotune(ScrnInfoPtr pScrn);
+extern void ScfbFlushReport(ScrnInfoPtr pScrn);
+extern void ScfbShadowUpdate(ScreenPtr pScreen, shadowBufPtr pBuf);
+extern Bool ScfbMirrorStart(ScreenPtr pScreen);
+extern void ScfbRepaint(ScrnInfoPtr pScrn);
+extern void ScfbPanApply(ScrnInfoPtr pScrn);
+extern void ScfbGammaInit(ScrnInfoPtr pScrn);
+extern void ScfbGammaLoad(ScrnInfoPtr pScrn, int numColors, int *indices,
+			  LOCO *colors);
+extern Bool ScfbLatencyStart(ScreenPtr pScreen);
+extern void ScfbLatencyStop(ScreenPtr pScreen);
+extern void ScfbLatencyInput(ScrnInfoPtr pScrn);
+extern void ScfbLatencyReport(ScrnInfoPtr pScrn);
+
+#endif /* SCFB_H */
@@ -0,0 +1,880 @@
+/*
+ * Copyright © 2001-2012 Matthieu Herrb
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *    - Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    - Redistributions in binary form must reproduce the above
+ *      copyright notice, this list of conditions and the following
+ *      disclaimer in the documentation and/or other materials provided
+ *      with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ * ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/*
+ * Drawing fast paths on the shadow framebuffer.  The GC and window
+ * wrappers below sit on top of the damage layer, so everything they do
+ * not handle themselves still goes through damage and fb.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <string.h>
+
+#include "xf86.h"
+#include "gcstruct.h"
+#include "servermd.h"
+#include "windowstr.h"
+#include "fb.h"
+
+#include "scfb.h"
+#include "scfb_kernels.h"
+
+typedef struct {
+	const GCFuncs		*funcs;
+	const GCOps		*ops; /* NULL unless drawing to a window. */
+} ScfbGCPrivRec, *ScfbGCPrivPtr;
+
+static DevPrivateKeyRec scfbGCPrivateKeyRec;
+#define scfbGCPrivateKey (&scfbGCPrivateKeyRec)
+
+#define scfbGetGCPriv(pGC) ((ScfbGCPrivPtr) \
+	dixLookupPrivate(&(pGC)->devPrivates, scfbGCPrivateKey))
+
+static const GCFuncs scfbGCFuncs;
+static const GCOps scfbGCOps;
+
+#define SCFB_GC_FUNC_PROLOGUE(pGC) \
+	ScfbGCPrivPtr pGCPriv = scfbGetGCPriv(pGC); \
+	(pGC)->funcs = pGCPriv->funcs; \
+	if (pGCPriv->ops) \
+		(pGC)->ops = pGCPriv->ops
+
+#define SCFB_GC_FUNC_EPILOGUE(pGC) \
+	pGCPriv->funcs = (pGC)->funcs; \
+	(pGC)->funcs = &scfbGCFuncs; \
+	if (pGCPriv->ops) { \
+		pGCPriv->ops = (pGC)->ops; \
+		(pGC)->ops = &scfbGCOps; \
+	}
+
+#define SCFB_GC_OP_PROLOGUE(pGC) \
+	ScfbGCPrivPtr pGCPriv = scfbGetGCPriv(pGC); \
+	const GCFuncs *oldFuncs = (pGC)->funcs; \
+	(pGC)->funcs = pGCPriv->funcs; \
+	(pGC)->ops = pGCPriv->ops
+
+#define SCFB_GC_OP_EPILOGUE(pGC) \
+	pGCPriv->ops = (pGC)->ops; \
+	(pGC)->funcs = oldFuncs; \
+	(pGC)->ops = &scfbGCOps
+
+/*
+ * Whether shadow and framebuffer coordinates are the same right now, and
+ * the framebuffer may be written around the flush: not while recording,
+ * which only sees what is flushed.
+ */
+static Bool
+scfbFramebufferDirect(ScrnInfoPtr pScrn)
+{
+	ScfbPtr fPtr = SCFBPTR(pScrn);
+
+	return pScrn->vtSema && !fPtr->bypass &&
+	    fPtr->rotate == SCFB_ROTATE_NONE &&
+	    fPtr->rrRotation == RR_Rotate_0 &&
+	    fPtr->scale == SCFB_SCALE_ONE && fPtr->exportMap == NULL &&
+	    !fPtr->swizzle && !fPtr->gamma && fPtr->packDepth == 0 &&
+	    !fPtr->expand && !fPtr->panning && fPtr->recordFd == -1 &&
+	    !fPtr->dirtyNotify;
+}
+
+/*
+ * Scrolling.  The shadow is updated by fb as usual; what is saved is the
+ * flush of the destination, when the framebuffer can cheaply be read
+ * and so the same move can be done there instead.  Only the parts of
+ * the source that are already up to date in the framebuffer are moved.
+ */
+static Bool
+scfbScrollBegin(WindowPtr pWin, RegionPtr pSrc, RegionPtr pClip,
+    unsigned int subWindowMode, int dx, int dy, RegionPtr pMoved)
+{
+	ScreenPtr pScreen = pWin->drawable.pScreen;
+	ScrnInfoPtr pScrn = xf86ScreenToScrn(pScreen);
+	ScfbPtr fPtr = SCFBPTR(pScrn);
+	BoxPtr ext;
+
+	if (!fPtr->scrollInPlace || !scfbFramebufferDirect(pScrn))
+		return FALSE;
+	/* Not for windows redirected to a pixmap of their own. */
+	if (fbGetWindowPixmap(pWin) != pScreen->GetScreenPixmap(pScreen))
+		return FALSE;
+	/* Straight scrolls only. */
+	if ((dx != 0) == (dy != 0))
+		return FALSE;
+
+	/*
+	 * Let the software cursor take itself out of the source now rather
+	 * than during the copy, so that what it restores is shadow damage
+	 * by the time the framebuffer is compared, and is not moved.
+	 */
+	if (pScreen->SourceValidate != NULL) {
+		ext = RegionExtents(pSrc);
+		(*pScreen->SourceValidate)(&pWin->drawable,
+		    ext->x1 - pWin->drawable.x, ext->y1 - pWin->drawable.y,
+		    ext->x2 - ext->x1, ext->y2 - ext->y1
+#if GET_ABI_MAJOR(ABI_VIDEODRV_VERSION) >= 10
+		    , subWindowMode
+#endif
+		    );
+	}
+
+	ScfbFlushSync(pScrn);
+	RegionNull(pMoved);
+	RegionSubtract(pMoved, pSrc, DamageRegion(fPtr->shadowDamage));
+	RegionTranslate(pMoved, dx, dy);
+	RegionIntersect(pMoved, pMoved, pClip);
+	if (!RegionNotEmpty(pMoved)) {
+		RegionUninit(pMoved);
+		return FALSE;
+	}
+	return TRUE;
+}
+
+static void
+scfbScrollEnd(ScrnInfoPtr pScrn, RegionPtr pMoved, int dx, int dy)
+{
+	ScfbPtr fPtr = SCFBPTR(pScrn);
+	BoxPtr pbox = RegionRects(pMoved);
+	int nbox = RegionNumRects(pMoved);
+	int cpp = pScrn->bitsPerPixel / 8;
+	int lb = fPtr->linebytes;
+	int i, y, step;
+	size_t n;
+	CARD8 *dst;
+
+	/* Boxes and rows in the order that keeps overlapping moves right. */
+	step = 1;
+	if (dy > 0 || dx > 0) {
+		pbox += nbox - 1;
+		step = -1;
+	}
+	for (i = 0; i < nbox; i++, pbox += step) {
+		n = (pbox->x2 - pbox->x1) * cpp;
+		if (dy > 0) {
+			for (y = pbox->y2 - 1; y >= pbox->y1; y--) {
+				dst = fPtr->fbmem + y * lb + pbox->x1 * cpp;
+				memmove(dst, dst - dy * lb - dx * cpp, n);
+			}
+		} else {
+			for (y = pbox->y1; y < pbox->y2; y++) {
+				dst = fPtr->fbmem + y * lb + pbox->x1 * cpp;
+				memmove(dst, dst - dy * lb - dx * cpp, n);
+			}
+		}
+	}
+
+	RegionSubtract(DamageRegion(fPtr->shadowDamage),
+	    DamageRegion(fPtr->shadowDamage), pMoved);
+	RegionUninit(pMoved);
+}
+
+static Bool
+scfbFullPlanemask(GCPtr pGC)
+{
+	unsigned long mask;
+
+	mask = pGC->depth >= 32 ? 0xffffffffUL : (1UL << pGC->depth) - 1;
+	return (pGC->planemask & mask) == mask;
+}
+
+/*
+ * Solid fills.  Plain GXcopy fills with a full planemask are done here
+ * with the fill kernel, and the damage layer is told about the whole
+ * request at once.
+ */
+static Bool
+scfbSolidOK(DrawablePtr pDraw, GCPtr pGC)
+{
+	if (pGC->fillStyle != FillSolid || pGC->alu != GXcopy ||
+	    !scfbFullPlanemask(pGC))
+		return FALSE;
+	switch (pDraw->bitsPerPixel) {
+	case 8:
+	case 16:
+	case 32:
+		return TRUE;
+	default:
+		return FALSE;
+	}
+}
+
+/*
+ * Fill the boxes of pRegion, in screen coordinates, and damage them.
+ * Damage is reported before drawing, as the damage layer's own wrappers
+ * do, so that the software cursor is out of the way first.
+ */
+static void
+scfbSolidRegion(DrawablePtr pDraw, GCPtr pGC, RegionPtr pRegion)
+{
+	BoxPtr pbox = RegionRects(pRegion);
+	int nbox = RegionNumRects(pRegion);
+	int cpp = pDraw->bitsPerPixel / 8;
+	FbBits *bits;
+	FbStride stride;
+	int bpp, xoff, yoff;
+	ptrdiff_t pitch;
+
+	if (nbox == 0)
+		return;
+
+	DamageRegionAppend(pDraw, pRegion);
+	fbGetDrawable(pDraw, bits, stride, bpp, xoff, yoff);
+	pitch = stride * sizeof(FbBits);
+	for (; nbox > 0; nbox--, pbox++)
+		scfb_fill((CARD8 *)bits + (pbox->y1 + yoff) * pitch +
+		    (pbox->x1 + xoff) * cpp, pitch, pbox->x2 - pbox->x1,
+		    pbox->y2 - pbox->y1, pGC->fgPixel, cpp);
+	fbFinishAccess(pDraw);
+	DamageRegionProcessPending(pDraw);
+}
+
+/* Solid fill of rectangles in drawable coordinates. */
+static Bool
+scfbSolidRects(DrawablePtr pDraw, GCPtr pGC, int nrect, xRectangle *prect)
+{
+	RegionPtr pRegion;
+
+	pRegion = RegionFromRects(nrect, prect, CT_UNSORTED);
+	if (pRegion == NULL)
+		return FALSE;
+	RegionTranslate(pRegion, pDraw->x, pDraw->y);
+	RegionIntersect(pRegion, pRegion, fbGetCompositeClip(pGC));
+	scfbSolidRegion(pDraw, pGC, pRegion);
+	RegionDestroy(pRegion);
+	return TRUE;
+}
+
+/*
+ * Image uploads, from PutImage and from CopyArea out of a pixmap, which
+ * is also how MIT-SHM PutImage reaches us.  Pixels in the drawable's
+ * format are copied row by row.  When the window is drawn on the screen
+ * pixmap, the framebuffer is untransformed and no flush is in flight,
+ * the rows are also streamed to the framebuffer and need no flush.
+ */
+static Bool
+scfbImageOK(DrawablePtr pDraw, GCPtr pGC, int depth)
+{
+	return depth == pDraw->depth && pGC->alu == GXcopy &&
+	    scfbFullPlanemask(pGC) && (pDraw->bitsPerPixel == 8 ||
+	    pDraw->bitsPerPixel == 16 || pDraw->bitsPerPixel == 32);
+}
+
+/* (sx, sy) is the screen position of the first pixel of src. */
+static void
+scfbImageRegion(DrawablePtr pDraw, RegionPtr pRegion, const CARD8 *src,
+    ptrdiff_t spitch, int sx, int sy)
+{
+	ScrnInfoPtr pScrn = xf86ScreenToScrn(pDraw->pScreen);
+	ScfbPtr fPtr = SCFBPTR(pScrn);
+	BoxPtr pbox = RegionRects(pRegion);
+	int nbox = RegionNumRects(pRegion);
+	int cpp = pDraw->bitsPerPixel / 8;
+	const CARD8 *s;
+	FbBits *bits;
+	FbStride stride;
+	int bpp, xoff, yoff, y;
+	ptrdiff_t pitch;
+	size_t n;
+	Bool direct;
+
+	if (nbox == 0)
+		return;
+
+	DamageRegionAppend(pDraw, pRegion);
+	fbGetDrawable(pDraw, bits, stride, bpp, xoff, yoff);
+	pitch = stride * sizeof(FbBits);
+	direct = (void *)bits == fPtr->shadow && fPtr->shadowDamage != NULL &&
+	    !fPtr->flushRunning && scfbFramebufferDirect(pScrn);
+	for (; nbox > 0; nbox--, pbox++) {
+		n = (pbox->x2 - pbox->x1) * cpp;
+		for (y = pbox->y1; y < pbox->y2; y++) {
+			s = src + (y - sy) * spitch + (pbox->x1 - sx) * cpp;
+			memcpy((CARD8 *)bits + (y + yoff) * pitch +
+			    (pbox->x1 + xoff) * cpp, s, n);
+			if (direct)
+				scfb_copy_stream(fPtr->fbmem +
+				    y * fPtr->linebytes + pbox->x1 * cpp, s, n);
+		}
+	}
+	fbFinishAccess(pDraw);
+	DamageRegionProcessPending(pDraw);
+
+	/* What the software cursor restored outside pRegion stays damaged. */
+	if (direct)
+		RegionSubtract(DamageRegion(fPtr->shadowDamage),
+		    DamageRegion(fPtr->shadowDamage), pRegion);
+}
+
+static Bool
+scfbImageFromPixmap(DrawablePtr pSrc, DrawablePtr pDst, GCPtr pGC,
+    int srcx, int srcy, int w, int h, int dstx, int dsty)
+{
+	RegionRec region;
+	BoxRec box;
+	FbBits *bits;
+	FbStride stride;
+	int bpp, xoff, yoff;
+
+	/* All of the source must exist, so that nothing is exposed. */
+	if (pSrc->type != DRAWABLE_PIXMAP ||
+	    pSrc->bitsPerPixel != pDst->bitsPerPixel ||
+	    !scfbImageOK(pDst, pGC, pSrc->depth) || srcx < 0 || srcy < 0 ||
+	    srcx + w > pSrc->width || srcy + h > pSrc->height)
+		return FALSE;
+
+	box.x1 = pDst->x + dstx;
+	box.y1 = pDst->y + dsty;
+	box.x2 = box.x1 + w;
+	box.y2 = box.y1 + h;
+	RegionInit(&region, &box, 1);
+	RegionIntersect(&region, &region, fbGetCompositeClip(pGC));
+
+	fbGetDrawable(pSrc, bits, stride, bpp, xoff, yoff);
+	scfbImageRegion(pDst, &region, (CARD8 *)bits +
+	    (srcy + yoff) * stride * sizeof(FbBits) +
+	    (srcx + xoff) * (bpp / 8), stride * sizeof(FbBits),
+	    box.x1, box.y1);
+	fbFinishAccess(pSrc);
+	RegionUninit(&region);
+	return TRUE;
+}
+
+static RegionPtr
+scfbCopyArea(DrawablePtr pSrc, DrawablePtr pDst, GCPtr pGC,
+    int srcx, int srcy, int w, int h, int dstx, int dsty)
+{
+	ScrnInfoPtr pScrn = xf86ScreenToScrn(pGC->pScreen);
+	RegionPtr ret;
+	RegionRec src, moved;
+	BoxRec box;
+	Bool scroll = FALSE;
+	SCFB_GC_OP_PROLOGUE(pGC);
+
+	if (scfbImageFromPixmap(pSrc, pDst, pGC, srcx, srcy, w, h,
+		dstx, dsty)) {
+		SCFB_GC_OP_EPILOGUE(pGC);
+		return NULL;
+	}
+
+	if (pSrc == pDst && pGC->alu == GXcopy && scfbFullPlanemask(pGC) &&
+	    pGC->subWindowMode == ClipByChildren) {
+		box.x1 = pSrc->x + srcx;
+		box.y1 = pSrc->y + srcy;
+		box.x2 = box.x1 + w;
+		box.y2 = box.y1 + h;
+		RegionInit(&src, &box, 1);
+		RegionIntersect(&src, &src, &((WindowPtr)pSrc)->clipList);
+		scroll = scfbScrollBegin((WindowPtr)pSrc, &src,
+		    fbGetCompositeClip(pGC), pGC->subWindowMode,
+		    dstx - srcx, dsty - srcy, &moved);
+		RegionUninit(&src);
+	}
+
+	ret = (*pGC->ops->CopyArea)(pSrc, pDst, pGC, srcx, srcy, w, h,
+	    dstx, dsty);
+
+	if (scroll)
+		scfbScrollEnd(pScrn, &moved, dstx - srcx, dsty - srcy);
+	SCFB_GC_OP_EPILOGUE(pGC);
+	return ret;
+}
+
+static void
+scfbCopyWindow(WindowPtr pWin, DDXPointRec ptOldOrg, RegionPtr prgnSrc)
+{
+	ScreenPtr pScreen = pWin->drawable.pScreen;
+	ScrnInfoPtr pScrn = xf86ScreenToScrn(pScreen);
+	ScfbPtr fPtr = SCFBPTR(pScrn);
+	int dx = pWin->drawable.x - ptOldOrg.x;
+	int dy = pWin->drawable.y - ptOldOrg.y;
+	RegionRec moved;
+	Bool scroll;
+
+	/* Before fb, which translates prgnSrc in place. */
+	scroll = scfbScrollBegin(pWin, prgnSrc, &pWin->borderClip,
+	    IncludeInferiors, dx, dy, &moved);
+
+	pScreen->CopyWindow = fPtr->CopyWindow;
+	(*pScreen->CopyWindow)(pWin, ptOldOrg, prgnSrc);
+	fPtr->CopyWindow = pScreen->CopyWindow;
+	pScreen->CopyWindow = scfbCopyWindow;
+
+	if (scroll)
+		scfbScrollEnd(pScrn, &moved, dx, dy);
+}
+
+/* GC funcs */
+
+static void
+scfbValidateGC(GCPtr pGC, unsigned long changes, DrawablePtr pDraw)
+{
+	SCFB_GC_FUNC_PROLOGUE(pGC);
+	(*pGC->funcs->ValidateGC)(pGC, changes, pDraw);
+	if (pDraw->type == DRAWABLE_WINDOW)
+		pGCPriv->ops = pGC->ops;
+	else
+		pGCPriv->ops = NULL;
+	SCFB_GC_FUNC_EPILOGUE(pGC);
+}
+
+static void
+scfbChangeGC(GCPtr pGC, unsigned long mask)
+{
+	SCFB_GC_FUNC_PROLOGUE(pGC);
+	(*pGC->funcs->ChangeGC)(pGC, mask);
+	SCFB_GC_FUNC_EPILOGUE(pGC);
+}
+
+static void
+scfbCopyGC(GCPtr pGCSrc, unsigned long mask, GCPtr pGCDst)
+{
+	SCFB_GC_FUNC_PROLOGUE(pGCDst);
+	(*pGCDst->funcs->CopyGC)(pGCSrc, mask, pGCDst);
+	SCFB_GC_FUNC_EPILOGUE(pGCDst);
+}
+
+static void
+scfbDestroyGC(GCPtr pGC)
+{
+	SCFB_GC_FUNC_PROLOGUE(pGC);
+	(*pGC->funcs->DestroyGC)(pGC);
+	SCFB_GC_FUNC_EPILOGUE(pGC);
+}
+
+static void
+scfbChangeClip(GCPtr pGC, int type, pointer pvalue, int nrects)
+{
+	SCFB_GC_FUNC_PROLOGUE(pGC);
+	(*pGC->funcs->ChangeClip)(pGC, type, pvalue, nrects);
+	SCFB_GC_FUNC_EPILOGUE(pGC);
+}
+
+static void
+scfbCopyClip(GCPtr pgcDst, GCPtr pgcSrc)
+{
+	SCFB_GC_FUNC_PROLOGUE(pgcDst);
+	(*pgcDst->funcs->CopyClip)(pgcDst, pgcSrc);
+	SCFB_GC_FUNC_EPILOGUE(pgcDst);
+}
+
+static void
+scfbDestroyClip(GCPtr pGC)
+{
+	SCFB_GC_FUNC_PROLOGUE(pGC);
+	(*pGC->funcs->DestroyClip)(pGC);
+	SCFB_GC_FUNC_EPILOGUE(pGC);
+}
+
+static const GCFuncs scfbGCFuncs = {
+	scfbValidateGC, scfbChangeGC, scfbCopyGC, scfbDestroyGC,
+	scfbChangeClip, scfbDestroyClip, scfbCopyClip
+};
+
+/* GC ops not accelerated here, passed straight down. */
+
+/*
+ * Spans are in screen coordinates already, fb sets miTranslate.  The
+ * damage reported up front is the bounds of the spans within the clip.
+ */
+static void
+scfbSolidSpans(DrawablePtr pDraw, GCPtr pGC, int n, DDXPointPtr ppt,
+    int *pwidth)
+{
+	RegionPtr pClip = fbGetCompositeClip(pGC);
+	BoxPtr ext = RegionExtents(pClip);
+	BoxPtr pbox;
+	BoxRec damage;
+	RegionRec region;
+	int cpp = pDraw->bitsPerPixel / 8;
+	FbBits *bits;
+	FbStride stride;
+	int bpp, xoff, yoff;
+	ptrdiff_t pitch;
+	int i, nbox, x1, x2, y;
+
+	damage.x1 = damage.y1 = MAXSHORT;
+	damage.x2 = damage.y2 = -MAXSHORT;
+	for (i = 0; i < n; i++) {
+		damage.x1 = min(damage.x1, ppt[i].x);
+		damage.x2 = max(damage.x2, ppt[i].x + pwidth[i]);
+		damage.y1 = min(damage.y1, ppt[i].y);
+		damage.y2 = max(damage.y2, ppt[i].y + 1);
+	}
+	damage.x1 = max(damage.x1, ext->x1);
+	damage.x2 = min(damage.x2, ext->x2);
+	damage.y1 = max(damage.y1, ext->y1);
+	damage.y2 = min(damage.y2, ext->y2);
+	if (damage.x1 >= damage.x2 || damage.y1 >= damage.y2)
+		return;
+	RegionInit(&region, &damage, 1);
+	DamageRegionAppend(pDraw, &region);
+
+	fbGetDrawable(pDraw, bits, stride, bpp, xoff, yoff);
+	pitch = stride * sizeof(FbBits);
+	for (; n > 0; n--, ppt++, pwidth++) {
+		y = ppt->y;
+		if (y < ext->y1 || y >= ext->y2)
+			continue;
+		for (pbox = RegionRects(pClip), nbox = RegionNumRects(pClip);
+		     nbox > 0; nbox--, pbox++) {
+			if (y < pbox->y1 || y >= pbox->y2)
+				continue;
+			x1 = max(ppt->x, pbox->x1);
+			x2 = min(ppt->x + *pwidth, pbox->x2);
+			if (x1 >= x2)
+				continue;
+			scfb_fill((CARD8 *)bits + (y + yoff) * pitch +
+			    (x1 + xoff) * cpp, pitch, x2 - x1, 1,
+			    pGC->fgPixel, cpp);
+		}
+	}
+	fbFinishAccess(pDraw);
+
+	DamageRegionProcessPending(pDraw);
+	RegionUninit(&region);
+}
+
+static void
+scfbFillSpans(DrawablePtr pDraw, GCPtr pGC, int nInit, DDXPointPtr pptInit,
+    int *pwidthInit, int fSorted)
+{
+	SCFB_GC_OP_PROLOGUE(pGC);
+	if (pGC->miTranslate && scfbSolidOK(pDraw, pGC))
+		scfbSolidSpans(pDraw, pGC, nInit, pptInit, pwidthInit);
+	else
+		(*pGC->ops->FillSpans)(pDraw, pGC, nInit, pptInit, pwidthInit,
+		    fSorted);
+	SCFB_GC_OP_EPILOGUE(pGC);
+}
+
+static void
+scfbSetSpans(DrawablePtr pDraw, GCPtr pGC, char *pcharsrc, DDXPointPtr ppt,
+    int *pwidth, int nspans, int fSorted)
+{
+	SCFB_GC_OP_PROLOGUE(pGC);
+	(*pGC->ops->SetSpans)(pDraw, pGC, pcharsrc, ppt, pwidth, nspans,
+	    fSorted);
+	SCFB_GC_OP_EPILOGUE(pGC);
+}
+
+static void
+scfbPutImage(DrawablePtr pDraw, GCPtr pGC, int depth, int x, int y, int w,
+    int h, int leftPad, int format, char *pImage)
+{
+	RegionRec region;
+	BoxRec box;
+	SCFB_GC_OP_PROLOGUE(pGC);
+
+	if (format == ZPixmap && leftPad == 0 &&
+	    scfbImageOK(pDraw, pGC, depth)) {
+		box.x1 = pDraw->x + x;
+		box.y1 = pDraw->y + y;
+		box.x2 = box.x1 + w;
+		box.y2 = box.y1 + h;
+		RegionInit(&region, &box, 1);
+		RegionIntersect(&region, &region, fbGetCompositeClip(pGC));
+		scfbImageRegion(pDraw, &region, (CARD8 *)pImage,
+		    PixmapBytePad(w, depth), box.x1, box.y1);
+		RegionUninit(&region);
+	} else
+		(*pGC->ops->PutImage)(pDraw, pGC, depth, x, y, w, h, leftPad,
+		    format, pImage);
+	SCFB_GC_OP_EPILOGUE(pGC);
+}
+
+static RegionPtr
+scfbCopyPlane(DrawablePtr pSrc, DrawablePtr pDst, GCPtr pGC, int srcx,
+    int srcy, int w, int h, int dstx, int dsty, unsigned long bitPlane)
+{
+	RegionPtr ret;
+	SCFB_GC_OP_PROLOGUE(pGC);
+	ret = (*pGC->ops->CopyPlane)(pSrc, pDst, pGC, srcx, srcy, w, h,
+	    dstx, dsty, bitPlane);
+	SCFB_GC_OP_EPILOGUE(pGC);
+	return ret;
+}
+
+static void
+scfbPolyPoint(DrawablePtr pDraw, GCPtr pGC, int mode, int npt,
+    DDXPointPtr pptInit)
+{
+	SCFB_GC_OP_PROLOGUE(pGC);
+	(*pGC->ops->PolyPoint)(pDraw, pGC, mode, npt, pptInit);
+	SCFB_GC_OP_EPILOGUE(pGC);
+}
+
+static void
+scfbPolylines(DrawablePtr pDraw, GCPtr pGC, int mode, int npt,
+    DDXPointPtr pptInit)
+{
+	SCFB_GC_OP_PROLOGUE(pGC);
+	(*pGC->ops->Polylines)(pDraw, pGC, mode, npt, pptInit);
+	SCFB_GC_OP_EPILOGUE(pGC);
+}
+
+/*
+ * Thin solid horizontal and vertical segments are rectangles one pixel
+ * wide; anything else goes to fb as a whole.
+ */
+static Bool
+scfbSolidSegments(DrawablePtr pDraw, GCPtr pGC, int nseg, xSegment *pSeg)
+{
+	xRectangle *prect, *r;
+	int i, a, b, notLast;
+	Bool ret;
+
+	if (pGC->lineWidth != 0 || pGC->lineStyle != LineSolid)
+		return FALSE;
+	for (i = 0; i < nseg; i++)
+		if (pSeg[i].x1 != pSeg[i].x2 && pSeg[i].y1 != pSeg[i].y2)
+			return FALSE;
+
+	prect = malloc(nseg * sizeof(xRectangle));
+	if (prect == NULL)
+		return FALSE;
+	notLast = pGC->capStyle == CapNotLast;
+	for (i = 0, r = prect; i < nseg; i++, pSeg++) {
+		if (pSeg->y1 == pSeg->y2) {
+			a = pSeg->x1;
+			b = pSeg->x2;
+		} else {
+			a = pSeg->y1;
+			b = pSeg->y2;
+		}
+		/* The last point is the second one. */
+		if (a <= b)
+			b -= notLast;
+		else {
+			int t = a;
+
+			a = b + notLast;
+			b = t;
+		}
+		if (a > b)
+			continue;
+		if (pSeg->y1 == pSeg->y2) {
+			r->x = a;
+			r->y = pSeg->y1;
+			r->width = b - a + 1;
+			r->height = 1;
+		} else {
+			r->x = pSeg->x1;
+			r->y = a;
+			r->width = 1;
+			r->height = b - a + 1;
+		}
+		r++;
+	}
+	ret = scfbSolidRects(pDraw, pGC, r - prect, prect);
+	free(prect);
+	return ret;
+}
+
+static void
+scfbPolySegment(DrawablePtr pDraw, GCPtr pGC, int nseg, xSegment *pSeg)
+{
+	SCFB_GC_OP_PROLOGUE(pGC);
+	if (!scfbSolidOK(pDraw, pGC) ||
+	    !scfbSolidSegments(pDraw, pGC, nseg, pSeg))
+		(*pGC->ops->PolySegment)(pDraw, pGC, nseg, pSeg);
+	SCFB_GC_OP_EPILOGUE(pGC);
+}
+
+static void
+scfbPolyRectangle(DrawablePtr pDraw, GCPtr pGC, int nRects,
+    xRectangle *pRects)
+{
+	SCFB_GC_OP_PROLOGUE(pGC);
+	(*pGC->ops->PolyRectangle)(pDraw, pGC, nRects, pRects);
+	SCFB_GC_OP_EPILOGUE(pGC);
+}
+
+static void
+scfbPolyArc(DrawablePtr pDraw, GCPtr pGC, int narcs, xArc *parcs)
+{
+	SCFB_GC_OP_PROLOGUE(pGC);
+	(*pGC->ops->PolyArc)(pDraw, pGC, narcs, parcs);
+	SCFB_GC_OP_EPILOGUE(pGC);
+}
+
+static void
+scfbFillPolygon(DrawablePtr pDraw, GCPtr pGC, int shape, int mode,
+    int count, DDXPointPtr pptInit)
+{
+	SCFB_GC_OP_PROLOGUE(pGC);
+	(*pGC->ops->FillPolygon)(pDraw, pGC, shape, mode, count, pptInit);
+	SCFB_GC_OP_EPILOGUE(pGC);
+}
+
+static void
+scfbPolyFillRect(DrawablePtr pDraw, GCPtr pGC, int nRectsInit,
+    xRectangle *pRectsInit)
+{
+	SCFB_GC_OP_PROLOGUE(pGC);
+	if (!scfbSolidOK(pDraw, pGC) ||
+	    !scfbSolidRects(pDraw, pGC, nRectsInit, pRectsInit))
+		(*pGC->ops->PolyFillRect)(pDraw, pGC, nRectsInit, pRectsInit);
+	SCFB_GC_OP_EPILOGUE(pGC);
+}
+
+static void
+scfbPolyFillArc(DrawablePtr pDraw, GCPtr pGC, int narcs, xArc *parcs)
+{
+	SCFB_GC_OP_PROLOGUE(pGC);
+	(*pGC->ops->PolyFillArc)(pDraw, pGC, narcs, parcs);
+	SCFB_GC_OP_EPILOGUE(pGC);
+}
+
+static int
+scfbPolyText8(DrawablePtr pDraw, GCPtr pGC, int x, int y, int count,
+    char *chars)
+{
+	int ret;
+	SCFB_GC_OP_PROLOGUE(pGC);
+	ret = (*pGC->ops->PolyText8)(pDraw, pGC, x, y, count, chars);
+	SCFB_GC_OP_EPILOGUE(pGC);
+	return ret;
+}
+
+static int
+scfbPolyText16(DrawablePtr pDraw, GCPtr pGC, int x, int y, int count,
+    unsigned short *chars)
+{
+	int ret;
+	SCFB_GC_OP_PROLOGUE(pGC);
+	ret = (*pGC->ops->PolyText16)(pDraw, pGC, x, y, count, chars);
+	SCFB_GC_OP_EPILOGUE(pGC);
+	return ret;
+}
+
+static void
+scfbImageText8(DrawablePtr pDraw, GCPtr pGC, int x, int y, int count,
+    char *chars)
+{
+	SCFB_GC_OP_PROLOGUE(pGC);
+	(*pGC->ops->ImageText8)(pDraw, pGC, x, y, count, chars);
+	SCFB_GC_OP_EPILOGUE(pGC);
+}
+
+static void
+scfbImageText16(DrawablePtr pDraw, GCPtr pGC, int x, int y, int count,
+    unsigned short *chars)
+{
+	SCFB_GC_OP_PROLOGUE(pGC);
+	(*pGC->ops->ImageText16)(pDraw, pGC, x, y, count, chars);
+	SCFB_GC_OP_EPILOGUE(pGC);
+}
+
+static void
+scfbImageGlyphBlt(DrawablePtr pDraw, GCPtr pGC, int x, int y,
+    unsigned int nglyph, CharInfoPtr *ppci, pointer pglyphBase)
+{
+	SCFB_GC_OP_PROLOGUE(pGC);
+	(*pGC->ops->ImageGlyphBlt)(pDraw, pGC, x, y, nglyph, ppci,
+	    pglyphBase);
+	SCFB_GC_OP_EPILOGUE(pGC);
+}
+
+static void
+scfbPolyGlyphBlt(DrawablePtr pDraw, GCPtr pGC, int x, int y,
+    unsigned int nglyph, CharInfoPtr *ppci, pointer pglyphBase)
+{
+	SCFB_GC_OP_PROLOGUE(pGC);
+	(*pGC->ops->PolyGlyphBlt)(pDraw, pGC, x, y, nglyph, ppci,
+	    pglyphBase);
+	SCFB_GC_OP_EPILOGUE(pGC);
+}
+
+static void
+scfbPushPixels(GCPtr pGC, PixmapPtr pBitMap, DrawablePtr pDraw, int dx,
+    int dy, int xOrg, int yOrg)
+{
+	SCFB_GC_OP_PROLOGUE(pGC);
+	(*pGC->ops->PushPixels)(pGC, pBitMap, pDraw, dx, dy, xOrg, yOrg);
+	SCFB_GC_OP_EPILOGUE(pGC);
+}
+
+static const GCOps scfbGCOps = {
+	scfbFillSpans, scfbSetSpans, scfbPutImage, scfbCopyArea,
+	scfbCopyPlane, scfbPolyPoint, scfbPolylines, scfbPolySegment,
+	scfbPolyRectangle, scfbPolyArc, scfbFillPolygon, scfbPolyFillRect,
+	scfbPolyFillArc, scfbPolyText8, scfbPolyText16, scfbImageText8,
+	scfbImageText16, scfbImageGlyphBlt, scfbPolyGlyphBlt, scfbPushPixels
+};
+
+static Bool
+scfbCreateGC(GCPtr pGC)
+{
+	ScreenPtr pScreen = pGC->pScreen;
+	ScfbPtr fPtr = SCFBPTR(xf86ScreenToScrn(pScreen));
+	ScfbGCPrivPtr pGCPriv = scfbGetGCPriv(pGC);
+	Bool ret;
+
+	pScreen->CreateGC = fPtr->CreateGC;
+	if ((ret = (*pScreen->CreateGC)(pGC))) {
+		pGCPriv->ops = NULL;
+		pGCPriv->funcs = pGC->funcs;
+		pGC->funcs = &scfbGCFuncs;
+	}
+	pScreen->CreateGC = scfbCreateGC;
+
+	return ret;
+}
+
+/*
+ * Called after shadowSetup(), so that the wrappers see drawing before
+ * the damage layer does.
+ */
+Bool
+ScfbAccelInit(ScreenPtr pScreen)
+{
+	ScfbPtr fPtr = SCFBPTR(xf86ScreenToScrn(pScreen));
+
+	if (!dixRegisterPrivateKey(scfbGCPrivateKey, PRIVATE_GC,
+		sizeof(ScfbGCPrivRec)))
+		return FALSE;
+
+	fPtr->CreateGC = pScreen->CreateGC;
+	pScreen->CreateGC = scfbCreateGC;
+	fPtr->CopyWindow = pScreen->CopyWindow;
+	pScreen->CopyWindow = scfbCopyWindow;
+	return TRUE;
+}
+
+void
+ScfbAccelFini(ScreenPtr pScreen)
+{
+	ScfbPtr fPtr = SCFBPTR(xf86ScreenToScrn(pScreen));
+
+	pScreen->CreateGC = fPtr->CreateGC;
+	pScreen->CopyWindow = fPtr->CopyWindow;
+}
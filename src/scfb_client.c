@@ -0,0 +1,393 @@
+/*
+ * Copyright © 2001-2012 Matthieu Herrb
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *    - Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    - Redistributions in binary form must reproduce the above
+ *      copyright notice, this list of conditions and the following
+ *      disclaimer in the documentation and/or other materials provided
+ *      with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ * ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+
+/*
+ * Damage and flush cost per client.  Each damaged area is charged to the
+ * owner of the window it falls in, the deepest one showing its first
+ * pixel, which is the window drawn to.  Flushes are not tied to clients:
+ * the pixels and time they took since the last accounting are shared out
+ * in proportion to the damage each client caused meanwhile.  Besides the
+ * totals, a decayed sum covering roughly the last SCFB_CLIENT_DECAY ms
+ * ranks the clients, whose top ones are published in a root window
+ * property and logged.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "xf86.h"
+#include "dixstruct.h"
+#include "client.h"
+#include "windowstr.h"
+#include "property.h"
+#include <X11/Xatom.h>
+
+#include "scfb.h"
+
+#define SCFB_CLIENT_PROPERTY	"_SCFB_CLIENT_COST"
+#define SCFB_CLIENT_TOP		8
+#define SCFB_CLIENT_DECAY	10000
+#define SCFB_CLIENT_NAME	32
+
+typedef struct {
+	CARD64			pending; /* Pixels damaged since accounting. */
+	CARD64			damage; /* Pixels damaged, */
+	CARD64			bytes; /* written to the framebuffer */
+	CARD64			ns; /* in that time. */
+	CARD64			recentDamage; /* The same, decayed. */
+	CARD64			recentBytes;
+	CARD64			recentNs;
+} ScfbClientCostRec, *ScfbClientCostPtr;
+
+/* A client gone, kept for the report at exit. */
+typedef struct {
+	ScfbClientCostRec	cost;
+	char			name[SCFB_CLIENT_NAME];
+	int			pid;
+} ScfbClientGoneRec, *ScfbClientGonePtr;
+
+typedef struct _ScfbClients {
+	ScfbClientCostRec	cost[MAXCLIENTS]; /* By client index. */
+	ScfbClientGoneRec	gone[SCFB_CLIENT_TOP]; /* Costliest first. */
+	int			goneCount;
+	CARD64			pending; /* Sum of cost[].pending. */
+	CARD64			flushPixels; /* Flush totals when last */
+	CARD64			flushNs; /* accounted. */
+	CARD32			accounted; /* Server time, ms. */
+	CARD32			logged;
+} ScfbClientsRec, *ScfbClientsPtr;
+
+/* Index of the client owning the window shown at (x, y). */
+static int
+scfbClientAt(ScreenPtr pScreen, int x, int y)
+{
+	WindowPtr pWin = pScreen->root, pChild;
+	BoxRec box;
+
+	if (pWin == NULL)
+		return 0;
+	pChild = pWin->firstChild;
+	while (pChild != NULL) {
+		if (pChild->viewable &&
+		    pChild->drawable.class == InputOutput &&
+		    RegionContainsPoint(&pChild->borderSize, x, y, &box)) {
+			pWin = pChild;
+			pChild = pWin->firstChild;
+		} else
+			pChild = pChild->nextSib;
+	}
+	return CLIENT_ID(pWin->drawable.id);
+}
+
+static void
+scfbClientDamage(DamagePtr pDamage, RegionPtr pRegion, void *closure)
+{
+	ScrnInfoPtr pScrn = closure;
+	ScfbClientsPtr cl = SCFBPTR(pScrn)->clientCosts;
+	BoxPtr pbox = RegionRects(pRegion);
+	int nbox = RegionNumRects(pRegion);
+	CARD64 area = 0;
+	int i;
+
+	if (nbox == 0)
+		return;
+	i = scfbClientAt(pScrn->pScreen, pbox->x1, pbox->y1);
+	for (; nbox > 0; nbox--, pbox++)
+		area += (CARD64)(pbox->x2 - pbox->x1) * (pbox->y2 - pbox->y1);
+	cl->cost[i].pending += area;
+	cl->pending += area;
+}
+
+/*
+ * Share out what was flushed since the last accounting, and decay the
+ * recent sums by the time elapsed.
+ */
+static void
+scfbClientAccount(ScrnInfoPtr pScrn, CARD32 now)
+{
+	ScfbPtr fPtr = SCFBPTR(pScrn);
+	ScfbClientsPtr cl = fPtr->clientCosts;
+	CARD32 dt = now - cl->accounted;
+	CARD32 keep = dt < SCFB_CLIENT_DECAY ? SCFB_CLIENT_DECAY - dt : 0;
+	CARD64 pixels, ns, bytes;
+	ScfbClientCostPtr c;
+	double share;
+	int i;
+
+	cl->accounted = now;
+	if (fPtr->flushRunning)
+		pthread_mutex_lock(&fPtr->flushLock);
+	pixels = fPtr->statPixels - cl->flushPixels;
+	ns = fPtr->statActualNs - cl->flushNs;
+	cl->flushPixels = fPtr->statPixels;
+	cl->flushNs = fPtr->statActualNs;
+	if (fPtr->flushRunning)
+		pthread_mutex_unlock(&fPtr->flushLock);
+	bytes = pixels * fPtr->info.vi_depth / 8;
+
+	for (i = 0; i < currentMaxClients; i++) {
+		c = &cl->cost[i];
+		c->recentDamage = c->recentDamage * keep / SCFB_CLIENT_DECAY;
+		c->recentBytes = c->recentBytes * keep / SCFB_CLIENT_DECAY;
+		c->recentNs = c->recentNs * keep / SCFB_CLIENT_DECAY;
+		if (c->pending == 0)
+			continue;
+		share = (double)c->pending / cl->pending;
+		c->damage += c->pending;
+		c->bytes += bytes * share;
+		c->ns += ns * share;
+		c->recentDamage += c->pending;
+		c->recentBytes += bytes * share;
+		c->recentNs += ns * share;
+		c->pending = 0;
+	}
+	cl->pending = 0;
+}
+
+static const char *
+scfbClientName(ClientPtr client)
+{
+	const char *name;
+
+	if (client->index == 0)
+		return "server";
+	name = GetClientCmdName(client);
+	return name != NULL ? name : "unknown";
+}
+
+/*
+ * Keep the totals of a client going away if it is among the costliest,
+ * and clear its slot for the next client with its index.
+ */
+static void
+scfbClientRetire(ScfbClientsPtr cl, ClientPtr client)
+{
+	ScfbClientCostPtr c = &cl->cost[client->index];
+	ScfbClientGonePtr g;
+	int i, n;
+
+	for (i = cl->goneCount; i > 0 && cl->gone[i - 1].cost.ns < c->ns; i--)
+		;
+	if (c->ns > 0 && i < SCFB_CLIENT_TOP) {
+		n = min(cl->goneCount, SCFB_CLIENT_TOP - 1);
+		memmove(&cl->gone[i + 1], &cl->gone[i],
+		    (n - i) * sizeof(cl->gone[0]));
+		cl->goneCount = n + 1;
+		g = &cl->gone[i];
+		g->cost = *c;
+		snprintf(g->name, sizeof(g->name), "%s",
+		    scfbClientName(client));
+		g->pid = GetClientPid(client);
+	}
+	cl->pending -= c->pending;
+	memset(c, 0, sizeof(*c));
+}
+
+static void
+scfbClientState(CallbackListPtr *list, void *data, void *args)
+{
+	ScrnInfoPtr pScrn = data;
+	ClientPtr client = ((NewClientInfoRec *)args)->client;
+
+	if (client->clientState == ClientStateGone)
+		scfbClientRetire(SCFBPTR(pScrn)->clientCosts, client);
+}
+
+/*
+ * Fill top with the indices of the connected clients with the most
+ * recent flush time, costliest first.  Returns how many there are.
+ */
+static int
+scfbClientTop(ScfbClientsPtr cl, int *top)
+{
+	CARD64 ns;
+	int i, j, n = 0;
+
+	for (i = 0; i < currentMaxClients; i++) {
+		ns = cl->cost[i].recentNs;
+		if (clients[i] == NULL || ns == 0)
+			continue;
+		for (j = n; j > 0 && cl->cost[top[j - 1]].recentNs < ns; j--)
+			;
+		if (j == SCFB_CLIENT_TOP)
+			continue;
+		n = min(n, SCFB_CLIENT_TOP - 1);
+		memmove(&top[j + 1], &top[j], (n - j) * sizeof(top[0]));
+		top[j] = i;
+		n++;
+	}
+	return n;
+}
+
+static void
+scfbClientLog(ScrnInfoPtr pScrn, const char *name, int pid,
+	      CARD64 damage, CARD64 bytes, CARD64 ns)
+{
+	xf86DrvMsg(pScrn->scrnIndex, X_INFO, "  %s (pid %d): %llu kpixels "
+	    "damaged, %llu kB flushed in %llu ms\n", name, pid,
+	    (unsigned long long)(damage / 1000),
+	    (unsigned long long)(bytes / 1024),
+	    (unsigned long long)(ns / 1000000));
+}
+
+/*
+ * Publish the clients costliest lately, four integers each: the base of
+ * their resource ids, as xrestop shows it, then the kilopixels they
+ * damaged and the kilobytes and microseconds of flushing they caused.
+ * They are logged too, every clientLog seconds unless it is 0.
+ */
+void
+ScfbClientPublish(ScrnInfoPtr pScrn)
+{
+	ScfbPtr fPtr = SCFBPTR(pScrn);
+	ScfbClientsPtr cl = fPtr->clientCosts;
+	ScreenPtr pScreen = pScrn->pScreen;
+	CARD32 now = GetTimeInMillis(), value[4 * SCFB_CLIENT_TOP];
+	int top[SCFB_CLIENT_TOP];
+	ScfbClientCostPtr c;
+	Atom atom;
+	int i, n;
+
+	if (cl == NULL || pScreen->root == NULL ||
+	    now - cl->accounted < fPtr->statsInterval)
+		return;
+	scfbClientAccount(pScrn, now);
+
+	n = scfbClientTop(cl, top);
+	for (i = 0; i < n; i++) {
+		c = &cl->cost[top[i]];
+		value[i * 4] = clients[top[i]]->clientAsMask;
+		value[i * 4 + 1] = min(c->recentDamage / 1000, 0xffffffff);
+		value[i * 4 + 2] = min(c->recentBytes / 1024, 0xffffffff);
+		value[i * 4 + 3] = min(c->recentNs / 1000, 0xffffffff);
+	}
+	atom = MakeAtom(SCFB_CLIENT_PROPERTY,
+	    sizeof(SCFB_CLIENT_PROPERTY) - 1, TRUE);
+	dixChangeWindowProperty(serverClient, pScreen->root, atom, XA_INTEGER,
+	    32, PropModeReplace, 4 * n, value, FALSE);
+
+	if (n == 0 || fPtr->clientLog == 0 ||
+	    now - cl->logged < (CARD32)fPtr->clientLog * 1000)
+		return;
+	cl->logged = now;
+	xf86DrvMsg(pScrn->scrnIndex, X_INFO,
+	    "Clients by flush time, lately:\n");
+	for (i = 0; i < n; i++) {
+		c = &cl->cost[top[i]];
+		scfbClientLog(pScrn, scfbClientName(clients[top[i]]),
+		    GetClientPid(clients[top[i]]), c->recentDamage,
+		    c->recentBytes, c->recentNs);
+	}
+}
+
+Bool
+ScfbClientStart(ScreenPtr pScreen)
+{
+	ScrnInfoPtr pScrn = xf86ScreenToScrn(pScreen);
+	ScfbPtr fPtr = SCFBPTR(pScrn);
+	PixmapPtr pPixmap = pScreen->GetScreenPixmap(pScreen);
+	ScfbClientsPtr cl;
+
+	cl = calloc(1, sizeof(ScfbClientsRec));
+	if (cl == NULL)
+		return FALSE;
+	fPtr->clientDamage = DamageCreate(scfbClientDamage, NULL,
+	    DamageReportRawRegion, TRUE, pScreen, pScrn);
+	if (fPtr->clientDamage == NULL) {
+		free(cl);
+		return FALSE;
+	}
+	if (!AddCallback(&ClientStateCallback, scfbClientState, pScrn)) {
+		DamageDestroy(fPtr->clientDamage);
+		fPtr->clientDamage = NULL;
+		free(cl);
+		return FALSE;
+	}
+	DamageRegister(&pPixmap->drawable, fPtr->clientDamage);
+	cl->flushPixels = fPtr->statPixels;
+	cl->flushNs = fPtr->statActualNs;
+	cl->accounted = cl->logged = GetTimeInMillis();
+	fPtr->clientCosts = cl;
+	return TRUE;
+}
+
+/*
+ * Log the costliest clients since the start.  By now most are gone;
+ * those still there are counted as if they were.
+ */
+void
+ScfbClientFini(ScrnInfoPtr pScrn)
+{
+	ScfbPtr fPtr = SCFBPTR(pScrn);
+	ScfbClientsPtr cl = fPtr->clientCosts;
+	ScfbClientGonePtr g;
+#if GET_ABI_MAJOR(ABI_VIDEODRV_VERSION) < 15
+	ScreenPtr pScreen;
+#endif
+	int i;
+
+	if (cl == NULL)
+		return;
+	DeleteCallback(&ClientStateCallback, scfbClientState, pScrn);
+	/*
+	 * Its callback uses the costs freed below, so take it off now
+	 * rather than let it go with the screen pixmap later in the close.
+	 */
+#if GET_ABI_MAJOR(ABI_VIDEODRV_VERSION) < 15
+	pScreen = xf86ScrnToScreen(pScrn);
+	DamageUnregister(&pScreen->GetScreenPixmap(pScreen)->drawable,
+	    fPtr->clientDamage);
+#else
+	DamageUnregister(fPtr->clientDamage);
+#endif
+	DamageDestroy(fPtr->clientDamage);
+	fPtr->clientDamage = NULL;
+	scfbClientAccount(pScrn, GetTimeInMillis());
+	for (i = 0; i < currentMaxClients; i++)
+		if (clients[i] != NULL)
+			scfbClientRetire(cl, clients[i]);
+
+	if (cl->goneCount > 0)
+		xf86DrvMsg(pScrn->scrnIndex, X_INFO,
+		    "Clients by flush time, since the start:\n");
+	for (i = 0; i < cl->goneCount; i++) {
+		g = &cl->gone[i];
+		scfbClientLog(pScrn, g->name, g->pid, g->cost.damage,
+		    g->cost.bytes, g->cost.ns);
+	}
+	free(cl);
+	fPtr->clientCosts = NULL;
+}
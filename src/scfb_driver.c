@@ -59,7 +59,9 @@
 #include "colormapst.h"
 #include "xf86cmap.h"
 #include "shadow.h"
+#include "damage.h"
 #include "dgaproc.h"
+#include <X11/extensions/randr.h>
 
 /* For visuals */
 #ifdef HAVE_XF1BPP
@@ -80,6 +82,8 @@
 #endif
 
 #include "compat-api.h"
+#include "scfb.h"
+#include "scfb_kernels.h"
 
 #undef	DEBUG
 #define	DEBUG	1
@@ -104,9 +108,11 @@ static Bool ScfbProbe(DriverPtr, int);
 static Bool ScfbPreInit(ScrnInfoPtr, int);
 static Bool ScfbScreenInit(SCREEN_INIT_ARGS_DECL);
 static Bool ScfbCloseScreen(CLOSE_SCREEN_ARGS_DECL);
+static void ScfbFreeScreen(FREE_SCREEN_ARGS_DECL);
 static void *ScfbWindowLinear(ScreenPtr, CARD32, CARD32, int, CARD32 *,
 			      void *);
 static void ScfbPointerMoved(SCRN_ARG_TYPE, int, int);
+static void ScfbAdjustFrame(ADJUST_FRAME_ARGS_DECL);
 static Bool ScfbEnterVT(VT_FUNC_ARGS_DECL);
 static void ScfbLeaveVT(VT_FUNC_ARGS_DECL);
 static Bool ScfbSwitchMode(SWITCH_MODE_ARGS_DECL);
@@ -128,14 +134,9 @@ static Bool ScfbDriverFunc(ScrnInfoPtr pScrn, xorgDriverFuncOp op,
 				pointer ptr);
 
 /* Helper functions */
+static int scfb_open(const char *);
 static pointer scfb_mmap(size_t, off_t, int);
 
-enum { SCFB_ROTATE_NONE = 0,
-       SCFB_ROTATE_CCW = 90,
-       SCFB_ROTATE_UD = 180,
-       SCFB_ROTATE_CW = 270
-};
-
 /*
  * This is intentionally screen-independent.
  * It indicates the binding choice made in the first PreInit.
@@ -166,12 +167,52 @@ static SymTabRec ScfbChipsets[] = {
 /* Supported options */
 typedef enum {
 	OPTION_SHADOW_FB,
-	OPTION_ROTATE
+	OPTION_ROTATE,
+	OPTION_FLUSH_THREAD,
+	OPTION_FLUSH_CPU,
+	OPTION_SCALE,
+	OPTION_EXPORT_SHM,
+	OPTION_READ_MIRROR,
+	OPTION_SCROLL_IN_PLACE,
+	OPTION_FULLSCREEN_BYPASS,
+	OPTION_FLUSH_COALESCE,
+	OPTION_LATENCY_STATS,
+	OPTION_SHADOW_SWIZZLE,
+	OPTION_FLUSH_BACKOFF,
+	OPTION_RECORD_FLUSH,
+	OPTION_RECORD_PIXELS,
+	OPTION_RUNTIME_TUNING,
+	OPTION_SHADOW_DEPTH,
+	OPTION_PIXMAP_POOL,
+	OPTION_CLIENT_STATS,
+	OPTION_FLUSH_KERNEL,
+	OPTION_FLUSH_BUDGET,
+	OPTION_DIRTY_NOTIFY
 } ScfbOpts;
 
 static const OptionInfoRec ScfbOptions[] = {
 	{ OPTION_SHADOW_FB, "ShadowFB", OPTV_BOOLEAN, {0}, FALSE},
 	{ OPTION_ROTATE, "Rotate", OPTV_STRING, {0}, FALSE},
+	{ OPTION_FLUSH_THREAD, "FlushThread", OPTV_BOOLEAN, {0}, FALSE},
+	{ OPTION_FLUSH_CPU, "FlushCPU", OPTV_INTEGER, {0}, FALSE},
+	{ OPTION_SCALE, "Scale", OPTV_REAL, {0}, FALSE},
+	{ OPTION_EXPORT_SHM, "ExportShm", OPTV_STRING, {0}, FALSE},
+	{ OPTION_READ_MIRROR, "ReadMirror", OPTV_BOOLEAN, {0}, FALSE},
+	{ OPTION_SCROLL_IN_PLACE, "ScrollInPlace", OPTV_BOOLEAN, {0}, FALSE},
+	{ OPTION_FULLSCREEN_BYPASS, "FullscreenBypass", OPTV_BOOLEAN, {0}, FALSE},
+	{ OPTION_FLUSH_COALESCE, "FlushCoalesce", OPTV_BOOLEAN, {0}, FALSE},
+	{ OPTION_LATENCY_STATS, "LatencyStats", OPTV_BOOLEAN, {0}, FALSE},
+	{ OPTION_SHADOW_SWIZZLE, "ShadowSwizzle", OPTV_BOOLEAN, {0}, FALSE},
+	{ OPTION_FLUSH_BACKOFF, "FlushBackoff", OPTV_INTEGER, {0}, FALSE},
+	{ OPTION_RECORD_FLUSH, "RecordFlush", OPTV_STRING, {0}, FALSE},
+	{ OPTION_RECORD_PIXELS, "RecordPixels", OPTV_BOOLEAN, {0}, FALSE},
+	{ OPTION_RUNTIME_TUNING, "RuntimeTuning", OPTV_BOOLEAN, {0}, FALSE},
+	{ OPTION_SHADOW_DEPTH, "ShadowDepth", OPTV_INTEGER, {0}, FALSE},
+	{ OPTION_PIXMAP_POOL, "PixmapPool", OPTV_INTEGER, {0}, FALSE},
+	{ OPTION_CLIENT_STATS, "ClientStats", OPTV_INTEGER, {0}, FALSE},
+	{ OPTION_FLUSH_KERNEL, "FlushKernel", OPTV_STRING, {0}, FALSE},
+	{ OPTION_FLUSH_BUDGET, "FlushBudget", OPTV_INTEGER, {0}, FALSE},
+	{ OPTION_DIRTY_NOTIFY, "DirtyNotify", OPTV_BOOLEAN, {0}, FALSE},
 	{ -1, NULL, OPTV_NONE, {0}, FALSE}
 };
 
@@ -208,32 +249,6 @@ ScfbSetup(pointer module, pointer opts, int *errmaj, int *errmin)
 	}
 }
 
-/* Private data */
-typedef struct {
-	int			fd; /* File descriptor of open device. */
-	struct video_info	info;
-	int			linebytes; /* Number of bytes per row. */
-	unsigned char*		fbstart;
-	unsigned char*		fbmem;
-	size_t			fbmem_len;
-	int			rotate;
-	Bool			shadowFB;
-	void *			shadow;
-	CloseScreenProcPtr	CloseScreen;
-	CreateScreenResourcesProcPtr CreateScreenResources;
-	void			(*PointerMoved)(SCRN_ARG_TYPE, int, int);
-	EntityInfoPtr		pEnt;
-
-#ifdef XFreeXDGA
-	/* DGA info */
-	DGAModePtr		pDGAMode;
-	int			nDGAMode;
-#endif
-	OptionInfoPtr		Options;
-} ScfbRec, *ScfbPtr;
-
-#define SCFBPTR(p) ((ScfbPtr)((p)->driverPrivate))
-
 static Bool
 ScfbGetRec(ScrnInfoPtr pScrn)
 {
@@ -242,6 +257,9 @@ ScfbGetRec(ScrnInfoPtr pScrn)
 		return TRUE;
 
 	pScrn->driverPrivate = xnfcalloc(sizeof(ScfbRec), 1);
+	SCFBPTR(pScrn)->recordFd = -1;
+	SCFBPTR(pScrn)->statsInterval = 1000;
+	SCFBPTR(pScrn)->clientLog = -1;
 	return TRUE;
 }
 
@@ -251,6 +269,7 @@ ScfbFreeRec(ScrnInfoPtr pScrn)
 
 	if (pScrn->driverPrivate == NULL)
 		return;
+	free(SCFBPTR(pScrn)->devName);
 	free(pScrn->driverPrivate);
 	pScrn->driverPrivate = NULL;
 }
@@ -268,6 +287,18 @@ ScfbIdentify(int flags)
 			  ScfbChipsets);
 }
 
+/*
+ * Open the framebuffer device named by the "device" option, or fall back
+ * to the console.
+ */
+static int
+scfb_open(const char *dev)
+{
+	if (dev == NULL)
+		return xf86Info.consoleFd;
+	return open(dev, O_RDWR, 0);
+}
+
 /* Map the framebuffer's memory. */
 static pointer
 scfb_mmap(size_t len, off_t off, int fd)
@@ -321,8 +352,12 @@ ScfbProbe(DriverPtr drv, int flags)
 	for (i = 0; i < numDevSections; i++) {
 		ScrnInfoPtr pScrn = NULL;
 		dev = xf86FindOptionValue(devSections[i]->options, "device");
-		if ((fd = xf86Info.consoleFd) >= 0 &&
-		    ioctl(fd, FBIOGTYPE, &fb) != -1) {
+		if ((fd = scfb_open(dev)) == -1) {
+			xf86Msg(X_WARNING, "scfb: cannot open %s: %s\n",
+			    dev, strerror(errno));
+			continue;
+		}
+		if (ioctl(fd, FBIOGTYPE, &fb) != -1) {
 			entity = xf86ClaimFbSlot(drv, 0, devSections[i], TRUE);
 			pScrn = xf86ConfigFbEntity(NULL,0,entity,
 						   NULL,NULL,NULL,NULL);
@@ -335,16 +370,19 @@ ScfbProbe(DriverPtr drv, int flags)
 				pScrn->PreInit = ScfbPreInit;
 				pScrn->ScreenInit = ScfbScreenInit;
 				pScrn->SwitchMode = ScfbSwitchMode;
-				pScrn->AdjustFrame = NULL;
+				pScrn->AdjustFrame = ScfbAdjustFrame;
 				pScrn->EnterVT = ScfbEnterVT;
 				pScrn->LeaveVT = ScfbLeaveVT;
 				pScrn->ValidMode = ScfbValidMode;
+				pScrn->FreeScreen = ScfbFreeScreen;
 
 				xf86DrvMsg(pScrn->scrnIndex, X_INFO,
 				    "using %s\n", dev != NULL ? dev :
 				    "default device");
 			}
 		}
+		if (fd != xf86Info.consoleFd)
+			close(fd);
 	}
 	free(devSections);
 	TRACE("probe done");
@@ -356,12 +394,13 @@ ScfbPreInit(ScrnInfoPtr pScrn, int flags)
 {
 	ScfbPtr fPtr;
 	struct fbtype fb;
-	int default_depth, wstype;
+	int default_depth, fbbpp, wstype, depth, poolKB;
 	const char *dev;
 	char *mod = NULL;
 	const char *reqSym = NULL, *s;
 	Gamma zeros = {0.0, 0.0, 0.0};
 	DisplayModePtr mode;
+	double scale;
 
 	if (flags & PROBE_DETECT) return FALSE;
 
@@ -382,10 +421,18 @@ ScfbPreInit(ScrnInfoPtr pScrn, int flags)
 #endif
 
 	dev = xf86FindOptionValue(fPtr->pEnt->device->options, "device");
-	fPtr->fd = xf86Info.consoleFd;
+	fPtr->fd = scfb_open(dev);
 	if (fPtr->fd == -1) {
+		xf86DrvMsg(pScrn->scrnIndex, X_ERROR, "%s: %s\n",
+		    dev != NULL ? dev : "console", strerror(errno));
 		return FALSE;
 	}
+	fPtr->fdOwned = (fPtr->fd != xf86Info.consoleFd);
+	/* For clients mapping the framebuffer themselves, e.g. with DGA. */
+	if (dev == NULL)
+		dev = ttyname(fPtr->fd);
+	if (dev != NULL)
+		fPtr->devName = strdup(dev);
 
 	if (ioctl(fPtr->fd, FBIOGTYPE, &fb) == -1) {
 		xf86DrvMsg(pScrn->scrnIndex, X_ERROR,
@@ -408,19 +455,46 @@ ScfbPreInit(ScrnInfoPtr pScrn, int flags)
 			   "ioctl FBIO_GETLINEWIDTH fail: %s. "
 			   "Falling back to width * bytes per pixel.\n",
 			   strerror(errno));
-		fPtr->linebytes = fPtr->info.vi_width *
-		    fPtr->info.vi_pixel_size;
+		fPtr->linebytes = (fPtr->info.vi_width *
+		    fPtr->info.vi_depth + 7) / 8;
+	}
+
+	/*
+	 * Below 8 bpp the shadow framebuffer is 8 bpp, which must be known
+	 * before setting up the depth.  The option is processed again with
+	 * the others.
+	 */
+	if ((fPtr->info.vi_depth == 1 || fPtr->info.vi_depth == 4) &&
+	    xf86CheckBoolOption(fPtr->pEnt->device->options, "ShadowFB",
+		TRUE)) {
+		fPtr->packDepth = fPtr->info.vi_depth;
+		fPtr->packLut[1] = 1;
+		fPtr->packThreshold = scfb_lut_threshold(fPtr->packLut,
+		    &fPtr->packInvert);
 	}
+	/* Likewise a depth 16 shadow over a 32 bpp framebuffer. */
+	s = xf86FindOptionValue(fPtr->pEnt->device->options, "ShadowDepth");
+	if (fPtr->info.vi_depth == 32 && s != NULL && atoi(s) == 16 &&
+	    xf86CheckBoolOption(fPtr->pEnt->device->options, "ShadowFB",
+		TRUE))
+		fPtr->expand = TRUE;
 
 	/* Handle depth */
 	default_depth = fPtr->info.vi_depth <= 24 ? fPtr->info.vi_depth : 24;
-	if (!xf86SetDepthBpp(pScrn, default_depth, default_depth,
-		fPtr->info.vi_depth,
+	fbbpp = fPtr->info.vi_depth;
+	if (fPtr->packDepth != 0) {
+		/* Sixteen colours stay so, monochrome gets a colormap. */
+		default_depth = fPtr->packDepth == 4 ? 4 : 8;
+		fbbpp = 8;
+	}
+	if (fPtr->expand)
+		default_depth = fbbpp = 16;
+	if (!xf86SetDepthBpp(pScrn, default_depth, default_depth, fbbpp,
 		fPtr->info.vi_depth >= 24 ? Support24bppFb|Support32bppFb : 0))
 		return FALSE;
 
 	/* Check consistency. */
-	if (pScrn->bitsPerPixel != fPtr->info.vi_depth) {
+	if (pScrn->bitsPerPixel != fbbpp) {
 		xf86DrvMsg(pScrn->scrnIndex, X_ERROR,
 		    "specified depth (%d) or bpp (%d) doesn't match "
 		    "framebuffer depth (%d)\n", pScrn->depth,
@@ -438,7 +512,15 @@ ScfbPreInit(ScrnInfoPtr pScrn, int flags)
 		rgb zeros = { 0, 0, 0 }, masks = { 0, 0, 0 };
 #ifdef FBIO_GETRGBOFFS
 		struct fb_rgboffs offs;
+#endif
 
+		/* The screen is r5g6b5, only the flush sees these. */
+		if (fPtr->expand) {
+			fPtr->fbOffset.red = 16;
+			fPtr->fbOffset.green = 8;
+			fPtr->fbOffset.blue = 0;
+		}
+#ifdef FBIO_GETRGBOFFS
 		if (ioctl(fPtr->fd, FBIO_GETRGBOFFS, &offs) == -1) {
 			xf86DrvMsg(pScrn->scrnIndex, X_INFO,
 				   "ioctl FBIO_GETRGBOFFS fail: %s. "
@@ -457,7 +539,15 @@ ScfbPreInit(ScrnInfoPtr pScrn, int flags)
 		 * avoid modifying the masks if they correspond to the default
 		 * values used by X.
 		 */
-		if ((offs.red != 0 || offs.green != 0 || offs.blue != 0) &&
+		if (fPtr->expand) {
+			if (offs.red != 0 || offs.green != 0 ||
+			    offs.blue != 0) {
+				fPtr->fbOffset.red = offs.red;
+				fPtr->fbOffset.green = offs.green;
+				fPtr->fbOffset.blue = offs.blue;
+			}
+		} else if ((offs.red != 0 || offs.green != 0 ||
+		    offs.blue != 0) &&
 		    !(offs.red == 16 && offs.green == 8 && offs.blue == 0)) {
 			masks.red = 0xff << offs.red;
 			masks.green = 0xff << offs.green;
@@ -501,8 +591,8 @@ ScfbPreInit(ScrnInfoPtr pScrn, int flags)
 	xf86ProcessOptions(pScrn->scrnIndex, fPtr->pEnt->device->options,
 			   fPtr->Options);
 
-	/* Use shadow framebuffer by default, on depth >= 8 */
-	if (pScrn->depth >= 8)
+	/* Use shadow framebuffer by default, 8 bpp when packing. */
+	if (pScrn->bitsPerPixel >= 8)
 		fPtr->shadowFB = xf86ReturnOptValBool(fPtr->Options,
 						      OPTION_SHADOW_FB, TRUE);
 	else
@@ -514,8 +604,9 @@ ScfbPreInit(ScrnInfoPtr pScrn, int flags)
 
 	/* Rotation */
 	fPtr->rotate = SCFB_ROTATE_NONE;
+	fPtr->rrRotation = RR_Rotate_0;
 	if ((s = xf86GetOptValString(fPtr->Options, OPTION_ROTATE))) {
-		if (pScrn->depth >= 8) {
+		if (pScrn->bitsPerPixel >= 8) {
 			if (!xf86NameCmp(s, "CW")) {
 				fPtr->shadowFB = TRUE;
 				fPtr->rotate = SCFB_ROTATE_CW;
@@ -541,10 +632,250 @@ ScfbPreInit(ScrnInfoPtr pScrn, int flags)
 			}
 		} else {
 			xf86DrvMsg(pScrn->scrnIndex, X_WARNING,
-			    "Option \"Rotate\" ignored on depth < 8");
+			    "Option \"Rotate\" ignored below 8 bpp without "
+			    "a shadow framebuffer\n");
+		}
+	}
+
+	/* Depth of the shadow, set up with the depth above. */
+	if (fPtr->expand)
+		xf86DrvMsg(pScrn->scrnIndex, X_CONFIG, "Rendering at depth 16, "
+		    "widening to 32 bpp when flushing\n");
+	else if (xf86GetOptValInteger(fPtr->Options, OPTION_SHADOW_DEPTH,
+		&depth))
+		xf86DrvMsg(pScrn->scrnIndex, X_WARNING, "Option \"ShadowDepth\" "
+		    "requires the shadow framebuffer, a 32 bpp framebuffer "
+		    "and a depth of 16, ignored\n");
+
+	/* Output scaling */
+	fPtr->scale = SCFB_SCALE_ONE;
+	if (xf86GetOptValReal(fPtr->Options, OPTION_SCALE, &scale) &&
+	    scale != 1.0) {
+		if (fPtr->info.vi_depth < 8) {
+			xf86DrvMsg(pScrn->scrnIndex, X_WARNING,
+			    "Option \"Scale\" ignored below 8 bpp\n");
+		} else if (fPtr->expand) {
+			xf86DrvMsg(pScrn->scrnIndex, X_WARNING,
+			    "Option \"Scale\" ignored with a depth 16 "
+			    "shadow\n");
+		} else if (scale < 1.0 || scale > 8.0) {
+			xf86DrvMsg(pScrn->scrnIndex, X_CONFIG,
+			    "\"%g\" is not a valid value for Option \"Scale\", "
+			    "must be between 1 and 8\n", scale);
+		} else {
+			fPtr->shadowFB = TRUE;
+			fPtr->scale = (int)(scale * SCFB_SCALE_ONE + 0.5);
+			fPtr->scaleInv = (int)(((INT64)1 << 32) / fPtr->scale);
+			xf86DrvMsg(pScrn->scrnIndex, X_CONFIG,
+			    "Scaling output by %g (%s)\n", scale,
+			    (fPtr->scale & 0xffff) == 0 ? "pixel replication" :
+			    pScrn->bitsPerPixel == 32 ? "bilinear" :
+			    "nearest neighbour");
+		}
+	}
+
+	/* Shared memory export of the shadow */
+	fPtr->exportName = xf86GetOptValString(fPtr->Options,
+	    OPTION_EXPORT_SHM);
+	if (fPtr->exportName != NULL && !fPtr->shadowFB) {
+		xf86DrvMsg(pScrn->scrnIndex, X_WARNING,
+		    "Option \"ExportShm\" requires the shadow framebuffer\n");
+		fPtr->exportName = NULL;
+	}
+
+	/*
+	 * Without a shadow, still render into system memory and write
+	 * through, unless told otherwise: framebuffer reads are slow.
+	 */
+	if (!fPtr->shadowFB && pScrn->depth >= 8) {
+		fPtr->mirrorFB = xf86ReturnOptValBool(fPtr->Options,
+		    OPTION_READ_MIRROR, TRUE);
+		if (fPtr->mirrorFB)
+			xf86DrvMsg(pScrn->scrnIndex, X_INFO,
+			    "Writing through a system memory copy of the "
+			    "framebuffer\n");
+	}
+
+	/*
+	 * Render in x8r8g8b8, which pixman has fast paths for, and reorder
+	 * the channels while flushing.
+	 */
+	if ((fPtr->shadowFB || fPtr->mirrorFB) && pScrn->depth == 24 &&
+	    pScrn->bitsPerPixel == 32 && (pScrn->mask.red != 0xff0000 ||
+	    pScrn->mask.green != 0xff00 || pScrn->mask.blue != 0xff)) {
+		fPtr->swizzle = xf86ReturnOptValBool(fPtr->Options,
+		    OPTION_SHADOW_SWIZZLE, FALSE);
+		if (fPtr->swizzle) {
+			fPtr->fbOffset = pScrn->offset;
+			pScrn->mask.red = 0xff0000;
+			pScrn->mask.green = 0xff00;
+			pScrn->mask.blue = 0xff;
+			pScrn->offset.red = 16;
+			pScrn->offset.green = 8;
+			pScrn->offset.blue = 0;
+			xf86DrvMsg(pScrn->scrnIndex, X_CONFIG,
+			    "Rendering in x8r8g8b8, reordering channels "
+			    "when flushing\n");
+		}
+	}
+
+	/*
+	 * Gamma ramps cannot be loaded into the hardware, apply them while
+	 * flushing instead.  The tables cover the low three bytes of a
+	 * shadow pixel.
+	 */
+	if ((fPtr->shadowFB || fPtr->mirrorFB) && pScrn->depth == 24 &&
+	    pScrn->bitsPerPixel == 32 && pScrn->offset.red <= 16 &&
+	    pScrn->offset.green <= 16 && pScrn->offset.blue <= 16)
+		fPtr->gammaSoft = TRUE;
+
+	/* Recording of the flushes, for replaying them elsewhere. */
+	fPtr->recordName = xf86GetOptValString(fPtr->Options,
+	    OPTION_RECORD_FLUSH);
+	if (fPtr->recordName != NULL && !fPtr->shadowFB && !fPtr->mirrorFB) {
+		xf86DrvMsg(pScrn->scrnIndex, X_WARNING,
+		    "Option \"RecordFlush\" requires the shadow framebuffer\n");
+		fPtr->recordName = NULL;
+	}
+	fPtr->recordPixels = xf86ReturnOptValBool(fPtr->Options,
+	    OPTION_RECORD_PIXELS, FALSE);
+
+	/* Merging of flushed boxes, with a shadow or mirror. */
+	if (fPtr->shadowFB || fPtr->mirrorFB)
+		fPtr->coalesce = xf86ReturnOptValBool(fPtr->Options,
+		    OPTION_FLUSH_COALESCE, TRUE);
+
+	/* How flushed rows are stored, timed at startup unless pinned. */
+	if ((fPtr->shadowFB || fPtr->mirrorFB) &&
+	    (s = xf86GetOptValString(fPtr->Options, OPTION_FLUSH_KERNEL)) &&
+	    xf86NameCmp(s, "auto") != 0) {
+		fPtr->flushKernel = ScfbFlushKernelLookup(s);
+		if (fPtr->flushKernel < 0) {
+			xf86DrvMsg(pScrn->scrnIndex, X_WARNING,
+			    "Unknown flush kernel \"%s\", timing them\n", s);
+			fPtr->flushKernel = 0;
+		} else {
+			fPtr->kernelPinned = TRUE;
+			xf86DrvMsg(pScrn->scrnIndex, X_CONFIG,
+			    "Flush kernel: %s\n", s);
 		}
 	}
 
+	/*
+	 * Telling the kernel what each flush changed, if it listens.  Asked
+	 * for where it does not, the calls only go into the recording.
+	 */
+	if ((fPtr->shadowFB || fPtr->mirrorFB) &&
+	    xf86ReturnOptValBool(fPtr->Options, OPTION_DIRTY_NOTIFY, TRUE)) {
+#ifdef HAVE_FBIO_DIRTY
+		struct fb_dirty dirty;
+
+		memset(&dirty, 0, sizeof(dirty));
+		if (ioctl(fPtr->fd, FBIO_DIRTY, &dirty) == 0)
+			fPtr->dirtyIoctl = TRUE;
+#endif
+		if (fPtr->dirtyIoctl) {
+			fPtr->dirtyNotify = TRUE;
+			xf86DrvMsg(pScrn->scrnIndex, X_INFO,
+			    "Telling the kernel which rectangles change\n");
+		} else if (xf86IsOptionSet(fPtr->Options,
+			OPTION_DIRTY_NOTIFY)) {
+			if (fPtr->recordName != NULL) {
+				fPtr->dirtyNotify = TRUE;
+				xf86DrvMsg(pScrn->scrnIndex, X_CONFIG,
+				    "Recording the rectangles the kernel "
+				    "would be told of\n");
+			} else
+				xf86DrvMsg(pScrn->scrnIndex, X_WARNING,
+				    "Option \"DirtyNotify\" is not supported "
+				    "by this kernel or device\n");
+		}
+	}
+
+	/* Pool for small pixmaps, its cap in kB. */
+	if (pScrn->bitsPerPixel >= 8) {
+		if (!xf86GetOptValInteger(fPtr->Options, OPTION_PIXMAP_POOL,
+			&poolKB))
+			poolKB = 0;
+		if (poolKB > 0) {
+			fPtr->poolMax = (size_t)poolKB * 1024;
+			xf86DrvMsg(pScrn->scrnIndex, X_CONFIG,
+			    "Pooling small pixmaps, up to %d kB\n", poolKB);
+		}
+	}
+
+	/* Flush knobs as root window properties. */
+	if (fPtr->shadowFB || fPtr->mirrorFB) {
+		fPtr->tuning = xf86ReturnOptValBool(fPtr->Options,
+		    OPTION_RUNTIME_TUNING, TRUE);
+		if (fPtr->tuning)
+			xf86DrvMsg(pScrn->scrnIndex, X_INFO,
+			    "Flush settings can be changed at run time\n");
+
+		if (xf86GetOptValInteger(fPtr->Options, OPTION_CLIENT_STATS,
+			&fPtr->clientLog)) {
+			if (fPtr->clientLog < 0) {
+				xf86DrvMsg(pScrn->scrnIndex, X_WARNING,
+				    "Option \"ClientStats\" must not be "
+				    "negative\n");
+				fPtr->clientLog = -1;
+			} else
+				xf86DrvMsg(pScrn->scrnIndex, X_CONFIG,
+				    "Counting damage and flush cost per "
+				    "client\n");
+		}
+	}
+
+	/* Flush worker, only useful with a shadow. */
+	fPtr->flushCPU = -1;
+	if (fPtr->shadowFB) {
+		fPtr->flushThreaded = xf86ReturnOptValBool(fPtr->Options,
+		    OPTION_FLUSH_THREAD, FALSE);
+		if (xf86GetOptValInteger(fPtr->Options, OPTION_FLUSH_CPU,
+			&fPtr->flushCPU)) {
+			fPtr->flushThreaded = TRUE;
+			xf86DrvMsg(pScrn->scrnIndex, X_CONFIG,
+			    "Binding flush thread to CPU %d\n", fPtr->flushCPU);
+		}
+		if (fPtr->flushThreaded)
+			xf86DrvMsg(pScrn->scrnIndex, X_CONFIG,
+			    "Flushing the shadow from a separate thread\n");
+
+		fPtr->scrollInPlace = xf86ReturnOptValBool(fPtr->Options,
+		    OPTION_SCROLL_IN_PLACE, FALSE);
+		if (fPtr->scrollInPlace)
+			xf86DrvMsg(pScrn->scrnIndex, X_CONFIG,
+			    "Scrolling inside the framebuffer\n");
+
+		fPtr->bypassAllowed = xf86ReturnOptValBool(fPtr->Options,
+		    OPTION_FULLSCREEN_BYPASS, FALSE);
+		if (fPtr->bypassAllowed)
+			xf86DrvMsg(pScrn->scrnIndex, X_CONFIG,
+			    "Bypassing the shadow for full screen windows\n");
+
+		fPtr->latencyStats = xf86ReturnOptValBool(fPtr->Options,
+		    OPTION_LATENCY_STATS, FALSE);
+		if (fPtr->latencyStats)
+			xf86DrvMsg(pScrn->scrnIndex, X_CONFIG,
+			    "Measuring damage to flush latency\n");
+
+		if (xf86GetOptValInteger(fPtr->Options, OPTION_FLUSH_BACKOFF,
+			&fPtr->backoffMax) && fPtr->backoffMax > 0)
+			xf86DrvMsg(pScrn->scrnIndex, X_CONFIG,
+			    "Holding back small updates for up to %d ms\n",
+			    fPtr->backoffMax);
+		else
+			fPtr->backoffMax = 0;
+
+		if (xf86GetOptValInteger(fPtr->Options, OPTION_FLUSH_BUDGET,
+			&fPtr->flushBudget) && fPtr->flushBudget > 0)
+			xf86DrvMsg(pScrn->scrnIndex, X_CONFIG,
+			    "Flushing for up to %d us at a time, near the "
+			    "pointer and focus first\n", fPtr->flushBudget);
+		else
+			fPtr->flushBudget = 0;
+	}
+
 	/* Fake video mode struct. */
 	mode = (DisplayModePtr)malloc(sizeof(DisplayModeRec));
 	mode->prev = mode;
@@ -553,12 +884,12 @@ ScfbPreInit(ScrnInfoPtr pScrn, int flags)
 	mode->status = MODE_OK;
 	mode->type = M_T_BUILTIN;
 	mode->Clock = 0;
-	mode->HDisplay = fPtr->info.vi_width;
+	mode->HDisplay = ((INT64)fPtr->info.vi_width << 16) / fPtr->scale;
 	mode->HSyncStart = 0;
 	mode->HSyncEnd = 0;
 	mode->HTotal = 0;
 	mode->HSkew = 0;
-	mode->VDisplay = fPtr->info.vi_height;
+	mode->VDisplay = ((INT64)fPtr->info.vi_height << 16) / fPtr->scale;
 	mode->VSyncStart = 0;
 	mode->VSyncEnd = 0;
 	mode->VTotal = 0;
@@ -569,8 +900,31 @@ ScfbPreInit(ScrnInfoPtr pScrn, int flags)
 		   "Ignoring mode specification from screen section\n");
 	}
 	pScrn->currentMode = pScrn->modes = mode;
-	pScrn->virtualX = fPtr->info.vi_width;
-	pScrn->virtualY = fPtr->info.vi_height;
+	pScrn->virtualX = mode->HDisplay;
+	pScrn->virtualY = mode->VDisplay;
+
+	/* A larger virtual screen is panned across the framebuffer. */
+	if (pScrn->display->virtualX > mode->HDisplay ||
+	    pScrn->display->virtualY > mode->VDisplay) {
+		if (!fPtr->shadowFB && !fPtr->mirrorFB)
+			xf86DrvMsg(pScrn->scrnIndex, X_WARNING,
+			    "Ignoring the virtual screen size, it requires "
+			    "the shadow framebuffer\n");
+		else if (fPtr->rotate != SCFB_ROTATE_NONE)
+			xf86DrvMsg(pScrn->scrnIndex, X_WARNING,
+			    "Ignoring the virtual screen size, it cannot be "
+			    "rotated\n");
+		else {
+			pScrn->virtualX = max(pScrn->display->virtualX,
+			    mode->HDisplay);
+			pScrn->virtualY = max(pScrn->display->virtualY,
+			    mode->VDisplay);
+			fPtr->panning = TRUE;
+			xf86DrvMsg(pScrn->scrnIndex, X_CONFIG,
+			    "Panning a %dx%d virtual screen\n",
+			    pScrn->virtualX, pScrn->virtualY);
+		}
+	}
 	pScrn->displayWidth = pScrn->virtualX;
 
 	/* Set the display resolution. */
@@ -612,18 +966,6 @@ ScfbPreInit(ScrnInfoPtr pScrn, int flags)
 	return TRUE;
 }
 
-static void
-scfbUpdateRotatePacked(ScreenPtr pScreen, shadowBufPtr pBuf)
-{
-    shadowUpdateRotatePacked(pScreen, pBuf);
-}
-
-static void
-scfbUpdatePacked(ScreenPtr pScreen, shadowBufPtr pBuf)
-{
-    shadowUpdatePacked(pScreen, pBuf);
-}
-
 static Bool
 ScfbCreateScreenResources(ScreenPtr pScreen)
 {
@@ -639,14 +981,23 @@ ScfbCreateScreenResources(ScreenPtr pScreen)
 	if (!ret)
 		return FALSE;
 
+	if (fPtr->clientLog >= 0 && !ScfbClientStart(pScreen))
+		return FALSE;
+	if (fPtr->mirrorFB)
+		return ScfbMirrorStart(pScreen);
+
 	pPixmap = pScreen->GetScreenPixmap(pScreen);
 
-	if (!shadowAdd(pScreen, pPixmap, fPtr->rotate ?
-		scfbUpdateRotatePacked : scfbUpdatePacked,
+	if (!shadowAdd(pScreen, pPixmap, ScfbShadowUpdate,
 		ScfbWindowLinear, fPtr->rotate, NULL)) {
 		return FALSE;
 	}
-	return TRUE;
+	fPtr->shadowDamage = shadowGetBuf(pScreen)->pDamage;
+	if (fPtr->latencyStats && !ScfbLatencyStart(pScreen))
+		return FALSE;
+	ScfbBackoffStart(pScrn);
+	ScfbBudgetStart(pScrn);
+	return ScfbFlushStart(pScrn);
 }
 
 
@@ -748,23 +1099,57 @@ ScfbScreenInit(SCREEN_INIT_ARGS_DECL)
 		int tmp = pScrn->virtualX;
 		pScrn->virtualX = pScrn->displayWidth = pScrn->virtualY;
 		pScrn->virtualY = tmp;
+		/* Keep the mode in screen orientation for RandR. */
+		pScrn->currentMode->HDisplay = pScrn->virtualX;
+		pScrn->currentMode->VDisplay = pScrn->virtualY;
 	}
-	if (fPtr->rotate && !fPtr->PointerMoved) {
+	/* RandR may rotate a shadowed screen later on. */
+	if (fPtr->shadowFB && !fPtr->PointerMoved) {
 		fPtr->PointerMoved = pScrn->PointerMoved;
 		pScrn->PointerMoved = ScfbPointerMoved;
 	}
 
 	fPtr->fbstart = fPtr->fbmem;
 
-	if (fPtr->shadowFB) {
-		fPtr->shadow = calloc(1, pScrn->virtualX * pScrn->virtualY *
-		    pScrn->bitsPerPixel/8);
+	if (fPtr->panning) {
+		ScfbAdjustFrame(ADJUST_FRAME_ARGS(pScrn, pScrn->frameX0,
+		    pScrn->frameY0));
+		fPtr->viewX = fPtr->panX;
+		fPtr->viewY = fPtr->panY;
+	}
+
+	if (fPtr->shadowFB || fPtr->mirrorFB) {
+		len = pScrn->virtualX * pScrn->virtualY *
+		    pScrn->bitsPerPixel/8;
+		if (fPtr->exportName != NULL) {
+			if (!ScfbExportInit(pScrn, len))
+				fPtr->exportName = NULL;
+		}
+		if (fPtr->exportName == NULL)
+			fPtr->shadow = calloc(1, len);
 
 		if (!fPtr->shadow) {
 			xf86DrvMsg(pScrn->scrnIndex, X_ERROR,
 			    "Failed to allocate shadow framebuffer\n");
 			return FALSE;
 		}
+		xf86DrvMsg(pScrn->scrnIndex, X_INFO, "Shadow framebuffer: "
+		    "%zu kB at %d bpp, framebuffer %zu kB at %d bpp\n",
+		    len / 1024, pScrn->bitsPerPixel, fPtr->fbmem_len / 1024,
+		    fPtr->info.vi_depth);
+		if (fPtr->recordName != NULL)
+			ScfbRecordInit(pScrn);
+		if (!ScfbFlushInit(pScrn)) {
+			xf86DrvMsg(pScrn->scrnIndex, X_ERROR,
+			    "Failed to allocate flush buffers\n");
+			return FALSE;
+		}
+		ScfbFlushAutotune(pScrn);
+		/* Tuning may turn coalescing on later. */
+		if (fPtr->coalesce || fPtr->tuning || fPtr->flushBudget > 0)
+			ScfbFlushCalibrate(pScrn);
+		if (fPtr->tuning)
+			ScfbTuneInit(pScrn);
 	}
 
 	switch (pScrn->bitsPerPixel) {
@@ -789,7 +1174,7 @@ ScfbScreenInit(SCREEN_INIT_ARGS_DECL)
 	case 24:
 	case 32:
 		ret = fbScreenInit(pScreen,
-		    fPtr->shadowFB ? fPtr->shadow : fPtr->fbstart,
+		    fPtr->shadow ? fPtr->shadow : fPtr->fbstart,
 		    pScrn->virtualX, pScrn->virtualY,
 		    pScrn->xDpi, pScrn->yDpi,
 		    pScrn->displayWidth, pScrn->bitsPerPixel);
@@ -803,6 +1188,9 @@ ScfbScreenInit(SCREEN_INIT_ARGS_DECL)
 	if (!ret)
 		return FALSE;
 
+	if (fPtr->poolMax > 0 && !ScfbPoolInit(pScreen))
+		fPtr->poolMax = 0;
+
 	if (pScrn->bitsPerPixel > 8) {
 		/* Fixup RGB ordering. */
 		visual = pScreen->visuals + pScreen->numVisuals;
@@ -828,22 +1216,21 @@ ScfbScreenInit(SCREEN_INIT_ARGS_DECL)
 		    "shadow framebuffer initialization failed\n");
 		return FALSE;
 	}
+	if (fPtr->shadowFB && !ScfbAccelInit(pScreen)) {
+		xf86DrvMsg(pScrn->scrnIndex, X_ERROR,
+		    "drawing fast path initialization failed\n");
+		return FALSE;
+	}
+	if (fPtr->mirrorFB) {
+		fPtr->CreateScreenResources = pScreen->CreateScreenResources;
+		pScreen->CreateScreenResources = ScfbCreateScreenResources;
+	}
 
 #ifdef XFreeXDGA
-	if (!fPtr->rotate)
-		ScfbDGAInit(pScrn, pScreen);
-	else
-		xf86DrvMsg(pScrn->scrnIndex, X_INFO, "Rotated display, "
-		    "disabling DGA\n");
+	ScfbDGAInit(pScrn, pScreen);
 #endif
-	if (fPtr->rotate) {
-		xf86DrvMsg(pScrn->scrnIndex, X_INFO, "Enabling Driver Rotation, "
-		    "disabling RandR\n");
-		xf86DisableRandR();
-		if (pScrn->bitsPerPixel == 24)
-			xf86DrvMsg(pScrn->scrnIndex, X_WARNING,
-			    "Rotation might be broken in 24 bpp\n");
-	}
+	if (fPtr->rotate)
+		xf86DrvMsg(pScrn->scrnIndex, X_INFO, "Enabling Driver Rotation\n");
 
 	xf86SetBlackWhitePixels(pScreen);
 	xf86SetBackingStore(pScreen);
@@ -862,6 +1249,10 @@ ScfbScreenInit(SCREEN_INIT_ARGS_DECL)
 	if (!miCreateDefColormap(pScreen))
 		return FALSE;
 	flags = CMAP_RELOAD_ON_MODE_SWITCH;
+	if (fPtr->gammaSoft) {
+		ScfbGammaInit(pScrn);
+		flags |= CMAP_PALETTED_TRUECOLOR;
+	}
 	ncolors = 256;
 	if(!xf86HandleColormaps(pScreen, ncolors, 8, ScfbLoadPalette,
 				NULL, flags))
@@ -894,13 +1285,44 @@ ScfbCloseScreen(CLOSE_SCREEN_ARGS_DECL)
 	ScrnInfoPtr pScrn = xf86ScreenToScrn(pScreen);
 	PixmapPtr pPixmap;
 	ScfbPtr fPtr = SCFBPTR(pScrn);
+	Bool ret;
 
 
 	TRACE_ENTER("ScfbCloseScreen");
 
 	pPixmap = pScreen->GetScreenPixmap(pScreen);
-	if (fPtr->shadowFB)
+	if (fPtr->shadowFB || fPtr->mirrorFB) {
+		ScfbFlushStop(pScrn);
+		ScfbBackoffStop(pScrn);
+		ScfbBudgetStop(pScrn);
+		ScfbRecordFini(pScrn);
+		ScfbTuneFini(pScrn);
+		ScfbClientFini(pScrn);
+		ScfbFlushReport(pScrn);
+		free(fPtr->flushBoxes);
+		fPtr->flushBoxes = NULL;
+		fPtr->flushBoxesLen = 0;
+		free(fPtr->flushLine);
+		fPtr->flushLine = NULL;
+	}
+	if (fPtr->shadowFB) {
+		if (fPtr->latencyStats)
+			ScfbLatencyReport(pScrn);
+		ScfbLatencyStop(pScreen);
+		ScfbAccelFini(pScreen);
 		shadowRemove(pScreen, pPixmap);
+		fPtr->shadowDamage = NULL;
+		if (fPtr->exportMap != NULL)
+			ScfbExportFini(pScrn);
+		else
+			free(fPtr->shadow);
+		fPtr->shadow = NULL;
+	} else if (fPtr->mirrorFB) {
+		/* The damage goes away with the screen pixmap. */
+		fPtr->mirrorDamage = NULL;
+		free(fPtr->shadow);
+		fPtr->shadow = NULL;
+	}
 
 	if (pScrn->vtSema) {
 		ScfbRestore(pScrn);
@@ -922,8 +1344,24 @@ ScfbCloseScreen(CLOSE_SCREEN_ARGS_DECL)
 
 	/* Unwrap CloseScreen. */
 	pScreen->CloseScreen = fPtr->CloseScreen;
+	ret = (*pScreen->CloseScreen)(CLOSE_SCREEN_ARGS);
+	/* fb destroyed the screen pixmap, the last one. */
+	if (fPtr->poolMax > 0)
+		ScfbPoolFini(pScrn);
 	TRACE_EXIT("ScfbCloseScreen");
-	return (*pScreen->CloseScreen)(CLOSE_SCREEN_ARGS);
+	return ret;
+}
+
+static void
+ScfbFreeScreen(FREE_SCREEN_ARGS_DECL)
+{
+	SCRN_INFO_PTR(arg);
+	ScfbPtr fPtr = SCFBPTR(pScrn);
+
+	TRACE_ENTER("FreeScreen");
+	if (fPtr != NULL && fPtr->fdOwned)
+		close(fPtr->fd);
+	ScfbFreeRec(pScrn);
 }
 
 static void *
@@ -942,33 +1380,28 @@ ScfbPointerMoved(SCRN_ARG_TYPE arg, int x, int y)
 {
     SCRN_INFO_PTR(arg);
     ScfbPtr fPtr = SCFBPTR(pScrn);
+    ScfbXformPtr xf = &fPtr->xform;
     int newX, newY;
 
-    switch (fPtr->rotate)
-    {
-    case SCFB_ROTATE_CW:
-	/* 90 degrees CW rotation. */
-	newX = pScrn->pScreen->height - y - 1;
-	newY = x;
-	break;
-
-    case SCFB_ROTATE_CCW:
-	/* 90 degrees CCW rotation. */
-	newX = y;
-	newY = pScrn->pScreen->width - x - 1;
-	break;
-
-    case SCFB_ROTATE_UD:
-	/* 180 degrees UD rotation. */
-	newX = pScrn->pScreen->width - x - 1;
-	newY = pScrn->pScreen->height - y - 1;
-	break;
-
-    default:
-	/* No rotation. */
-	newX = x;
-	newY = y;
-	break;
+    fPtr->inputSeen = TRUE;
+    fPtr->pointerX = x;
+    fPtr->pointerY = y;
+    ScfbLatencyInput(pScrn);
+
+    /* The frame of a virtual screen is panned in screen coordinates. */
+    if (fPtr->panning) {
+	(*fPtr->PointerMoved)(arg, x, y);
+	return;
+    }
+
+    /* Rotate back to framebuffer orientation, then scale. */
+    x -= xf->x0;
+    y -= xf->y0;
+    newX = xf->xx * x + xf->yx * y;
+    newY = xf->xy * x + xf->yy * y;
+    if (fPtr->scale != SCFB_SCALE_ONE) {
+	newX = ((INT64)newX * fPtr->scale) >> 16;
+	newY = ((INT64)newY * fPtr->scale) >> 16;
     }
 
     /* Pass adjusted pointer coordinates to wrapped PointerMoved function. */
@@ -989,11 +1422,28 @@ ScfbEnterVT(VT_FUNC_ARGS_DECL)
 static void
 ScfbLeaveVT(VT_FUNC_ARGS_DECL)
 {
-#if DEBUG
 	SCRN_INFO_PTR(arg);
-#endif
 
 	TRACE_ENTER("LeaveVT");
+	ScfbFlushSync(pScrn);
+	ScfbBypassStop(pScrn);
+}
+
+static void
+ScfbAdjustFrame(ADJUST_FRAME_ARGS_DECL)
+{
+	SCRN_INFO_PTR(arg);
+	ScfbPtr fPtr = SCFBPTR(pScrn);
+
+	/* Otherwise the whole framebuffer is always visible. */
+	if (!fPtr->panning)
+		return;
+
+	/* Moved before the next flush, see ScfbPanApply(). */
+	fPtr->panX = max(0, min(x, pScrn->virtualX -
+	    pScrn->currentMode->HDisplay));
+	fPtr->panY = max(0, min(y, pScrn->virtualY -
+	    pScrn->currentMode->VDisplay));
 }
 
 static Bool
@@ -1023,9 +1473,26 @@ static void
 ScfbLoadPalette(ScrnInfoPtr pScrn, int numColors, int *indices,
 	       LOCO *colors, VisualPtr pVisual)
 {
+	ScfbPtr fPtr = SCFBPTR(pScrn);
+	int i, n;
 
 	TRACE_ENTER("LoadPalette");
-	/* TODO */
+	/* A monochrome framebuffer shows pixels by their luminance. */
+	if (fPtr->packDepth == 1) {
+		for (i = 0; i < numColors; i++) {
+			n = indices[i];
+			fPtr->packLut[n] = colors[n].red * 77 +
+			    colors[n].green * 151 + colors[n].blue * 28 >=
+			    128 * 256;
+		}
+		fPtr->packThreshold = scfb_lut_threshold(fPtr->packLut,
+		    &fPtr->packInvert);
+		if (fPtr->shadowDamage != NULL)
+			ScfbRepaint(pScrn);
+	}
+	/* Truecolor palettes are the gamma ramps. */
+	if (fPtr->gammaSoft && (pVisual->class | DynamicClass) == DirectColor)
+		ScfbGammaLoad(pScrn, numColors, indices, colors);
 }
 
 static Bool
@@ -1085,10 +1552,15 @@ ScfbDGAOpenFramebuffer(ScrnInfoPtr pScrn, char **DeviceName,
 		       unsigned char **ApertureBase, int *ApertureSize,
 		       int *ApertureOffset, int *flags)
 {
-	*DeviceName = NULL;		/* No special device */
-	*ApertureBase = (unsigned char *)(pScrn->memPhysBase);
-	*ApertureSize = pScrn->videoRam;
-	*ApertureOffset = pScrn->fbOffset;
+	ScfbPtr fPtr = SCFBPTR(pScrn);
+
+	/* The client maps the device we map, from its start. */
+	if (fPtr->devName == NULL)
+		return FALSE;
+	*DeviceName = fPtr->devName;
+	*ApertureBase = NULL;
+	*ApertureSize = fPtr->fbmem_len;
+	*ApertureOffset = 0;
 	*flags = 0;
 
 	return TRUE;
@@ -1097,6 +1569,7 @@ ScfbDGAOpenFramebuffer(ScrnInfoPtr pScrn, char **DeviceName,
 static Bool
 ScfbDGASetMode(ScrnInfoPtr pScrn, DGAModePtr pDGAMode)
 {
+	ScfbPtr fPtr = SCFBPTR(pScrn);
 	DisplayModePtr pMode;
 	int frameX0, frameY0;
 
@@ -1115,6 +1588,20 @@ ScfbDGASetMode(ScrnInfoPtr pScrn, DGAModePtr pDGAMode)
 		return FALSE;
 	(*pScrn->AdjustFrame)(ADJUST_FRAME_ARGS(pScrn, frameX0, frameY0));
 
+	/*
+	 * The client owns the framebuffer until it leaves; the shadow or
+	 * mirror is not flushed meanwhile, and repainted in full afterwards.
+	 */
+	if (pDGAMode) {
+		ScfbFlushSync(pScrn);
+		ScfbBypassStop(pScrn);
+		fPtr->dgaActive = TRUE;
+	} else if (fPtr->dgaActive) {
+		fPtr->dgaActive = FALSE;
+		if (fPtr->shadow != NULL)
+			ScfbRepaint(pScrn);
+	}
+
 	return TRUE;
 }
 
@@ -1130,6 +1617,85 @@ ScfbDGAGetViewport(ScrnInfoPtr pScrn)
 	return (0);
 }
 
+static void
+ScfbDGASync(ScrnInfoPtr pScrn)
+{
+	ScfbFlushSync(pScrn);
+}
+
+/*
+ * Drawing on behalf of DGA clients, in framebuffer coordinates; DGA
+ * validates the rectangles against the mode.
+ */
+static void
+ScfbDGAFillRect(ScrnInfoPtr pScrn, int x, int y, int w, int h,
+    unsigned long color)
+{
+	ScfbPtr fPtr = SCFBPTR(pScrn);
+	int cpp = pScrn->bitsPerPixel / 8;
+
+	scfb_fill(fPtr->fbmem + y * fPtr->linebytes + x * cpp,
+	    fPtr->linebytes, w, h, color, cpp);
+}
+
+static void
+ScfbDGABlitRect(ScrnInfoPtr pScrn, int srcx, int srcy, int w, int h,
+    int dstx, int dsty)
+{
+	ScfbPtr fPtr = SCFBPTR(pScrn);
+	int cpp = pScrn->bitsPerPixel / 8;
+	int lb = fPtr->linebytes;
+	int i, step;
+	CARD8 *src, *dst;
+
+	src = fPtr->fbmem + srcy * lb + srcx * cpp;
+	dst = fPtr->fbmem + dsty * lb + dstx * cpp;
+	step = lb;
+	if (dsty > srcy) {
+		src += (h - 1) * lb;
+		dst += (h - 1) * lb;
+		step = -lb;
+	}
+	for (i = 0; i < h; i++, src += step, dst += step)
+		memmove(dst, src, w * cpp);
+}
+
+static void
+ScfbDGABlitTransRect(ScrnInfoPtr pScrn, int srcx, int srcy, int w, int h,
+    int dstx, int dsty, unsigned long color)
+{
+	ScfbPtr fPtr = SCFBPTR(pScrn);
+	int cpp = pScrn->bitsPerPixel / 8;
+	int lb = fPtr->linebytes;
+	int i, step;
+	CARD8 *src, *dst, *row = NULL;
+
+	/* Rows that overlap go through a copy. */
+	if (srcy < dsty + h && dsty < srcy + h &&
+	    srcx < dstx + w && dstx < srcx + w) {
+		row = malloc(w * cpp);
+		if (row == NULL)
+			return;
+	}
+
+	src = fPtr->fbmem + srcy * lb + srcx * cpp;
+	dst = fPtr->fbmem + dsty * lb + dstx * cpp;
+	step = lb;
+	if (dsty > srcy) {
+		src += (h - 1) * lb;
+		dst += (h - 1) * lb;
+		step = -lb;
+	}
+	for (i = 0; i < h; i++, src += step, dst += step) {
+		if (row != NULL) {
+			memcpy(row, src, w * cpp);
+			scfb_blit_trans(dst, row, w, color, cpp);
+		} else
+			scfb_blit_trans(dst, src, w, color, cpp);
+	}
+	free(row);
+}
+
 static DGAFunctionRec ScfbDGAFunctions =
 {
 	ScfbDGAOpenFramebuffer,
@@ -1137,10 +1703,10 @@ static DGAFunctionRec ScfbDGAFunctions =
 	ScfbDGASetMode,
 	ScfbDGASetViewport,
 	ScfbDGAGetViewport,
-	NULL,       /* Sync */
-	NULL,       /* FillRect */
-	NULL,       /* BlitRect */
-	NULL,       /* BlitTransRect */
+	ScfbDGASync,
+	ScfbDGAFillRect,
+	ScfbDGABlitRect,
+	ScfbDGABlitTransRect,
 };
 
 static void
@@ -1162,30 +1728,43 @@ ScfbDGAAddModes(ScrnInfoPtr pScrn)
 
 		++fPtr->nDGAMode;
 		pDGAMode->mode = pMode;
-		pDGAMode->flags = DGA_CONCURRENT_ACCESS | DGA_PIXMAP_AVAILABLE;
+		pDGAMode->flags = DGA_CONCURRENT_ACCESS | DGA_PIXMAP_AVAILABLE |
+			DGA_BLIT_RECT;
+		/* The fill and colour key kernels take 1, 2 or 4 byte pixels. */
+		if (pScrn->bitsPerPixel != 24)
+			pDGAMode->flags |= DGA_FILL_RECT | DGA_BLIT_RECT_TRANS;
 		pDGAMode->byteOrder = pScrn->imageByteOrder;
 		pDGAMode->depth = pScrn->depth;
 		pDGAMode->bitsPerPixel = pScrn->bitsPerPixel;
-		pDGAMode->red_mask = pScrn->mask.red;
-		pDGAMode->green_mask = pScrn->mask.green;
-		pDGAMode->blue_mask = pScrn->mask.blue;
+		if (fPtr->swizzle) {
+			/* The client draws in the framebuffer's order. */
+			pDGAMode->red_mask = 0xff << fPtr->fbOffset.red;
+			pDGAMode->green_mask = 0xff << fPtr->fbOffset.green;
+			pDGAMode->blue_mask = 0xff << fPtr->fbOffset.blue;
+		} else {
+			pDGAMode->red_mask = pScrn->mask.red;
+			pDGAMode->green_mask = pScrn->mask.green;
+			pDGAMode->blue_mask = pScrn->mask.blue;
+		}
 		pDGAMode->visualClass = pScrn->bitsPerPixel > 8 ?
 			TrueColor : PseudoColor;
 		pDGAMode->xViewportStep = 1;
 		pDGAMode->yViewportStep = 1;
-		pDGAMode->viewportWidth = pMode->HDisplay;
-		pDGAMode->viewportHeight = pMode->VDisplay;
+		/*
+		 * The client sees the framebuffer itself, which may be
+		 * rotated or scaled relative to the screen.
+		 */
+		pDGAMode->viewportWidth = fPtr->info.vi_width;
+		pDGAMode->viewportHeight = fPtr->info.vi_height;
 
 		pDGAMode->bytesPerScanline = fPtr->linebytes;
 
-		pDGAMode->imageWidth = pMode->HDisplay;
-		pDGAMode->imageHeight =  pMode->VDisplay;
+		pDGAMode->imageWidth = fPtr->info.vi_width;
+		pDGAMode->imageHeight = fPtr->info.vi_height;
 		pDGAMode->pixmapWidth = pDGAMode->imageWidth;
 		pDGAMode->pixmapHeight = pDGAMode->imageHeight;
-		pDGAMode->maxViewportX = pScrn->virtualX -
-			pDGAMode->viewportWidth;
-		pDGAMode->maxViewportY = pScrn->virtualY -
-			pDGAMode->viewportHeight;
+		pDGAMode->maxViewportX = 0;
+		pDGAMode->maxViewportY = 0;
 
 		pDGAMode->address = fPtr->fbstart;
 
@@ -1198,7 +1777,8 @@ ScfbDGAInit(ScrnInfoPtr pScrn, ScreenPtr pScreen)
 {
 	ScfbPtr fPtr = SCFBPTR(pScrn);
 
-	if (pScrn->depth < 8)
+	/* The framebuffer must be in the screen's pixel format. */
+	if (pScrn->depth < 8 || fPtr->packDepth != 0 || fPtr->expand)
 		return FALSE;
 
 	if (!fPtr->nDGAMode)
@@ -1209,6 +1789,72 @@ ScfbDGAInit(ScrnInfoPtr pScrn, ScreenPtr pScreen)
 }
 #endif
 
+/*
+ * Change the RandR rotation and reflection of a running screen.  The
+ * shadow keeps its size, so only the screen pixmap's shape, the flush
+ * mapping and the pointer transform change.
+ */
+Bool
+ScfbSetRotation(ScrnInfoPtr pScrn, int rotation)
+{
+	ScfbPtr fPtr = SCFBPTR(pScrn);
+	ScreenPtr pScreen = pScrn->pScreen;
+	PixmapPtr pPixmap;
+	CARD64 start;
+	int w, h, oldRotation, oldWidth;
+
+	if (rotation == fPtr->rrRotation)
+		return TRUE;
+	if (!fPtr->shadowFB || fPtr->panning)
+		return FALSE;
+
+	start = GetTimeInMicros();
+	ScfbFlushSync(pScrn);
+	ScfbBypassStop(pScrn);
+
+	/* The flush transform follows these, put them back on failure. */
+	oldRotation = fPtr->rrRotation;
+	oldWidth = pScrn->displayWidth;
+	fPtr->rrRotation = rotation;
+	if (rotation & (RR_Rotate_90 | RR_Rotate_270)) {
+		w = pScrn->virtualY;
+		h = pScrn->virtualX;
+	} else {
+		w = pScrn->virtualX;
+		h = pScrn->virtualY;
+	}
+	pScrn->displayWidth = w;
+	if (!ScfbFlushInit(pScrn)) {
+		fPtr->rrRotation = oldRotation;
+		pScrn->displayWidth = oldWidth;
+		ScfbFlushInit(pScrn);
+		return FALSE;
+	}
+
+	pPixmap = pScreen->GetScreenPixmap(pScreen);
+	if (!pScreen->ModifyPixmapHeader(pPixmap, w, h, -1, -1,
+		fPtr->shadowPitch, NULL)) {
+		fPtr->rrRotation = oldRotation;
+		pScrn->displayWidth = oldWidth;
+		ScfbFlushInit(pScrn);
+		return FALSE;
+	}
+
+	/* Repaint the whole framebuffer in one go. */
+	ScfbRepaint(pScrn);
+	/* Rotated rows take other paths, time them again. */
+	ScfbFlushAutotune(pScrn);
+
+	xf86DrvMsg(pScrn->scrnIndex, X_INFO,
+	    "Rotation set to %d degrees%s%s in %llu us\n",
+	    rotation & RR_Rotate_90 ? 90 : rotation & RR_Rotate_180 ? 180 :
+	    rotation & RR_Rotate_270 ? 270 : 0,
+	    rotation & RR_Reflect_X ? ", reflected in X" : "",
+	    rotation & RR_Reflect_Y ? ", reflected in Y" : "",
+	    (unsigned long long)(GetTimeInMicros() - start));
+	return TRUE;
+}
+
 static Bool
 ScfbDriverFunc(ScrnInfoPtr pScrn, xorgDriverFuncOp op,
     pointer ptr)
@@ -1220,6 +1866,16 @@ ScfbDriverFunc(ScrnInfoPtr pScrn, xorgDriverFuncOp op,
 		flag = (CARD32*)ptr;
 		(*flag) = 0;
 		return TRUE;
+	case RR_GET_INFO:
+		((xorgRRRotationPtr)ptr)->RRRotations = RR_Rotate_0;
+		if (SCFBPTR(pScrn)->shadowFB && !SCFBPTR(pScrn)->panning)
+			((xorgRRRotationPtr)ptr)->RRRotations |= RR_Rotate_90 |
+			    RR_Rotate_180 | RR_Rotate_270 |
+			    RR_Reflect_X | RR_Reflect_Y;
+		return TRUE;
+	case RR_SET_CONFIG:
+		return ScfbSetRotation(pScrn,
+		    ((xorgRRConfigPtr)ptr)->rotation);
 	default:
 		return FALSE;
 	}
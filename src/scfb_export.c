@@ -0,0 +1,164 @@
+/*
+ * Copyright © 2001-2012 Matthieu Herrb
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *    - Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    - Redistributions in binary form must reproduce the above
+ *      copyright notice, this list of conditions and the following
+ *      disclaimer in the documentation and/or other materials provided
+ *      with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ * ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/*
+ * Export of the shadow framebuffer and its damage through a POSIX shared
+ * memory object, for local screen mirroring.  See scfb_export.h.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "xf86.h"
+
+#include "scfb.h"
+#include "scfb_export.h"
+
+/*
+ * Create the shared object and place a shadow of len bytes in it.
+ */
+Bool
+ScfbExportInit(ScrnInfoPtr pScrn, size_t len)
+{
+	ScfbPtr fPtr = SCFBPTR(pScrn);
+	scfb_export_header *hdr;
+	size_t off, total;
+	int fd, pagemask;
+
+	pagemask = getpagesize() - 1;
+	off = (sizeof(scfb_export_header) + pagemask) & ~pagemask;
+	total = off + ((len + pagemask) & ~pagemask);
+
+	fd = shm_open(fPtr->exportName, O_RDWR | O_CREAT | O_TRUNC, 0600);
+	if (fd == -1) {
+		xf86DrvMsg(pScrn->scrnIndex, X_ERROR, "shm_open %s: %s\n",
+		    fPtr->exportName, strerror(errno));
+		return FALSE;
+	}
+	if (ftruncate(fd, total) == -1) {
+		xf86DrvMsg(pScrn->scrnIndex, X_ERROR, "ftruncate %s: %s\n",
+		    fPtr->exportName, strerror(errno));
+		close(fd);
+		shm_unlink(fPtr->exportName);
+		return FALSE;
+	}
+	hdr = mmap(NULL, total, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (hdr == MAP_FAILED) {
+		xf86DrvMsg(pScrn->scrnIndex, X_ERROR, "mmap %s: %s\n",
+		    fPtr->exportName, strerror(errno));
+		shm_unlink(fPtr->exportName);
+		return FALSE;
+	}
+
+	hdr->magic = SCFB_EXPORT_MAGIC;
+	hdr->version = SCFB_EXPORT_VERSION;
+	hdr->ring_size = SCFB_EXPORT_RING;
+	hdr->pixel_offset = off;
+	hdr->bpp = pScrn->bitsPerPixel;
+	hdr->depth = pScrn->depth;
+	hdr->red_mask = pScrn->mask.red;
+	hdr->green_mask = pScrn->mask.green;
+	hdr->blue_mask = pScrn->mask.blue;
+
+	fPtr->exportMap = hdr;
+	fPtr->exportLen = total;
+	fPtr->shadow = (CARD8 *)hdr + off;
+	xf86DrvMsg(pScrn->scrnIndex, X_INFO,
+	    "Exporting the shadow framebuffer as %s\n", fPtr->exportName);
+	return TRUE;
+}
+
+/* Publish the current shadow geometry. */
+void
+ScfbExportGeometry(ScrnInfoPtr pScrn)
+{
+	ScfbPtr fPtr = SCFBPTR(pScrn);
+	scfb_export_header *hdr = fPtr->exportMap;
+
+	if (hdr == NULL)
+		return;
+
+	hdr->width = fPtr->shadowWidth;
+	hdr->height = fPtr->shadowHeight;
+	hdr->pitch = fPtr->shadowPitch;
+	__atomic_store_n(&hdr->layout, hdr->layout + 1, __ATOMIC_RELEASE);
+}
+
+/* Append the rectangles of one flush to the ring and complete a frame. */
+void
+ScfbExportDamage(ScrnInfoPtr pScrn, RegionPtr pRegion)
+{
+	ScfbPtr fPtr = SCFBPTR(pScrn);
+	scfb_export_header *hdr = fPtr->exportMap;
+	BoxPtr pbox = RegionRects(pRegion);
+	int nbox = RegionNumRects(pRegion);
+	uint64_t head;
+	uint32_t frame;
+
+	if (hdr == NULL)
+		return;
+
+	head = hdr->head;
+	frame = hdr->frame + 1;
+	for (; nbox > 0; nbox--, pbox++, head++) {
+		scfb_export_rect *r = &hdr->ring[head & (SCFB_EXPORT_RING - 1)];
+
+		r->frame = frame;
+		r->x1 = pbox->x1;
+		r->y1 = pbox->y1;
+		r->x2 = pbox->x2;
+		r->y2 = pbox->y2;
+	}
+	__atomic_store_n(&hdr->head, head, __ATOMIC_RELEASE);
+	hdr->frame_usec = GetTimeInMicros();
+	__atomic_store_n(&hdr->frame, frame, __ATOMIC_RELEASE);
+}
+
+void
+ScfbExportFini(ScrnInfoPtr pScrn)
+{
+	ScfbPtr fPtr = SCFBPTR(pScrn);
+
+	if (fPtr->exportMap == NULL)
+		return;
+
+	munmap(fPtr->exportMap, fPtr->exportLen);
+	shm_unlink(fPtr->exportName);
+	fPtr->exportMap = NULL;
+	fPtr->shadow = NULL;
+}
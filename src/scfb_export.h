@@ -0,0 +1,84 @@
+/*
+ * Copyright © 2001-2012 Matthieu Herrb
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *    - Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    - Redistributions in binary form must reproduce the above
+ *      copyright notice, this list of conditions and the following
+ *      disclaimer in the documentation and/or other materials provided
+ *      with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ * ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/*
+ * Layout of the shared memory object published with Option "ExportShm".
+ *
+ * The object starts with a scfb_export_header, followed at pixel_offset
+ * by the shadow framebuffer itself, which the server renders into
+ * directly.  After every flush the server appends the flushed rectangles
+ * (shadow coordinates) to the ring, then advances head and frame.
+ *
+ * A consumer remembers the last head it has seen, h0.  To pick up new
+ * damage it reads head (h1, acquire), copies ring[h0 % ring_size] up to
+ * ring[(h1 - 1) % ring_size], reads the pixels they cover and then reads
+ * head again: if it advanced by more than ring_size past h0 in the
+ * meantime, or h1 - h0 already exceeded ring_size, rectangles were lost
+ * and the whole screen must be treated as damaged.  A change of layout
+ * (rotation) also means a full refresh, with the new width, height and
+ * pitch.  Pixels may be newer than the last published frame; their
+ * rectangles will then show up in a later frame.
+ */
+
+#ifndef SCFB_EXPORT_H
+#define SCFB_EXPORT_H
+
+#include <stdint.h>
+
+#define SCFB_EXPORT_MAGIC	0x42464353	/* "SCFB" */
+#define SCFB_EXPORT_VERSION	1
+#define SCFB_EXPORT_RING	1024		/* Must be a power of two. */
+
+typedef struct {
+	uint32_t		frame; /* Frame the rectangle belongs to. */
+	int16_t			x1, y1, x2, y2;
+} scfb_export_rect;
+
+typedef struct {
+	uint32_t		magic;
+	uint32_t		version;
+	uint32_t		ring_size;
+	uint32_t		pixel_offset; /* From the start of the object. */
+	uint32_t		layout; /* Bumped when the fields below change. */
+	uint32_t		width;
+	uint32_t		height;
+	uint32_t		pitch; /* Bytes per row. */
+	uint32_t		bpp;
+	uint32_t		depth;
+	uint32_t		red_mask;
+	uint32_t		green_mask;
+	uint32_t		blue_mask;
+	uint32_t		frame; /* Last completed frame. */
+	uint64_t		frame_usec; /* Its completion time, monotonic. */
+	uint64_t		head; /* Rectangles written so far. */
+	scfb_export_rect	ring[SCFB_EXPORT_RING];
+} scfb_export_header;
+
+#endif /* SCFB_EXPORT_H */
@@ -0,0 +1,1975 @@
+/*
+ * Copyright © 2001-2012 Matthieu Herrb
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *    - Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    - Redistributions in binary form must reproduce the above
+ *      copyright notice, this list of conditions and the following
+ *      disclaimer in the documentation and/or other materials provided
+ *      with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ * ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/*
+ * Shadow framebuffer flush: copies damaged parts of the shadow to the
+ * framebuffer, either from the server's BlockHandler or from a per-screen
+ * worker thread.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#ifdef HAVE_FBIO_DIRTY
+#include <sys/ioctl.h>
+#include <sys/fbio.h>
+#endif
+#ifdef __FreeBSD__
+#include <pthread_np.h>
+#include <sys/cpuset.h>
+#endif
+
+#include "xf86.h"
+#include "shadow.h"
+#include "windowstr.h"
+#include "inputstr.h"
+#include "property.h"
+#include <X11/Xatom.h>
+
+#include "scfb.h"
+#include "scfb_kernels.h"
+
+#define SCFB_LATENCY_PROPERTY	"_SCFB_FLUSH_LATENCY"
+#define SCFB_WAKEUPS_PROPERTY	"_SCFB_FLUSH_WAKEUPS"
+#define SCFB_DEFERRED_PROPERTY	"_SCFB_FLUSH_DEFERRED"
+
+/*
+ * Set up the framebuffer to shadow coordinate mapping and the scratch
+ * lines used when rows cannot be copied as they are.
+ */
+Bool
+ScfbFlushInit(ScrnInfoPtr pScrn)
+{
+	ScfbPtr fPtr = SCFBPTR(pScrn);
+	ScfbXformPtr xf = &fPtr->xform;
+	int w = pScrn->virtualX, h = pScrn->virtualY, angle = fPtr->rotate;
+	int vw, vh;
+
+	/* RandR rotates on top of the configured rotation. */
+	switch (fPtr->rrRotation & (RR_Rotate_90 | RR_Rotate_180 |
+		RR_Rotate_270)) {
+	case RR_Rotate_90:
+		angle += 90;
+		w = pScrn->virtualY;
+		h = pScrn->virtualX;
+		break;
+	case RR_Rotate_180:
+		angle += 180;
+		break;
+	case RR_Rotate_270:
+		angle += 270;
+		w = pScrn->virtualY;
+		h = pScrn->virtualX;
+		break;
+	}
+	angle %= 360;
+
+	fPtr->shadowWidth = w;
+	fPtr->shadowHeight = h;
+	fPtr->shadowPitch = pScrn->displayWidth * pScrn->bitsPerPixel / 8;
+
+	/* Only the viewport of a larger virtual screen is shown. */
+	if (fPtr->panning) {
+		vw = pScrn->currentMode->HDisplay;
+		vh = pScrn->currentMode->VDisplay;
+	} else {
+		vw = w;
+		vh = h;
+	}
+	fPtr->viewWidth = vw;
+	fPtr->viewHeight = vh;
+	if (angle == SCFB_ROTATE_CW || angle == SCFB_ROTATE_CCW) {
+		fPtr->imgWidth = vh;
+		fPtr->imgHeight = vw;
+	} else {
+		fPtr->imgWidth = vw;
+		fPtr->imgHeight = vh;
+	}
+
+	if (fPtr->flushLine == NULL) {
+		fPtr->flushLineLen = (max(max(w, h), fPtr->info.vi_width) + 1) *
+		    sizeof(CARD32);
+		fPtr->flushLine = malloc(3 * fPtr->flushLineLen);
+		if (fPtr->flushLine == NULL)
+			return FALSE;
+	}
+
+	memset(xf, 0, sizeof(*xf));
+	switch (angle) {
+	case SCFB_ROTATE_CW:
+		xf->xy = 1;
+		xf->yx = -1;
+		xf->y0 = vh - 1;
+		break;
+	case SCFB_ROTATE_CCW:
+		xf->xy = -1;
+		xf->x0 = vw - 1;
+		xf->yx = 1;
+		break;
+	case SCFB_ROTATE_UD:
+		xf->xx = -1;
+		xf->x0 = vw - 1;
+		xf->yy = -1;
+		xf->y0 = vh - 1;
+		break;
+	default:
+		xf->xx = 1;
+		xf->yy = 1;
+		break;
+	}
+
+	/* Reflections apply to the screen, before rotation. */
+	if (fPtr->rrRotation & RR_Reflect_X) {
+		xf->xx = -xf->xx;
+		xf->xy = -xf->xy;
+		xf->x0 = vw - 1 - xf->x0;
+	}
+	if (fPtr->rrRotation & RR_Reflect_Y) {
+		xf->yx = -xf->yx;
+		xf->yy = -xf->yy;
+		xf->y0 = vh - 1 - xf->y0;
+	}
+	xf->x0 += fPtr->viewX;
+	xf->y0 += fPtr->viewY;
+
+	ScfbExportGeometry(pScrn);
+	ScfbRecordGeometry(pScrn);
+	return TRUE;
+}
+
+/*
+ * Map a box in shadow coordinates to framebuffer orientation, before
+ * scaling.
+ */
+static void
+scfbXformBox(ScrnInfoPtr pScrn, const BoxRec *in, BoxPtr out)
+{
+	ScfbPtr fPtr = SCFBPTR(pScrn);
+	ScfbXformPtr xf = &fPtr->xform;
+	int x1 = in->x1 - xf->x0, y1 = in->y1 - xf->y0;
+	int x2 = in->x2 - 1 - xf->x0, y2 = in->y2 - 1 - xf->y0;
+	int u1, v1, u2, v2, t;
+
+	/* The inverse of a signed permutation is its transpose. */
+	u1 = xf->xx * x1 + xf->yx * y1;
+	v1 = xf->xy * x1 + xf->yy * y1;
+	u2 = xf->xx * x2 + xf->yx * y2;
+	v2 = xf->xy * x2 + xf->yy * y2;
+	if (u1 > u2) {
+		t = u1; u1 = u2; u2 = t;
+	}
+	if (v1 > v2) {
+		t = v1; v1 = v2; v2 = t;
+	}
+
+	out->x1 = max(u1, 0);
+	out->y1 = max(v1, 0);
+	out->x2 = min(u2 + 1, fPtr->imgWidth);
+	out->y2 = min(v2 + 1, fPtr->imgHeight);
+}
+
+/*
+ * Return pixels [u1, u2) of row v of the image in framebuffer orientation.
+ * They are gathered into buf unless inplace is set and the row is
+ * contiguous in the shadow.
+ */
+static CARD8 *
+scfbFetchRow(ScrnInfoPtr pScrn, CARD8 *buf, int u1, int u2, int v,
+	     Bool inplace)
+{
+	ScfbPtr fPtr = SCFBPTR(pScrn);
+	ScfbXformPtr xf = &fPtr->xform;
+	int cpp = pScrn->bitsPerPixel / 8;
+	ptrdiff_t step = xf->xx * cpp + xf->yx * fPtr->shadowPitch;
+	int x = xf->xx * u1 + xf->xy * v + xf->x0;
+	int y = xf->yx * u1 + xf->yy * v + xf->y0;
+	CARD8 *src = (CARD8 *)fPtr->shadow + y * fPtr->shadowPitch + x * cpp;
+
+	if (step == cpp && inplace)
+		return src;
+	scfb_fetch_step(buf, src, step, u2 - u1, cpp);
+	return buf;
+}
+
+/* Whether shadow pixels need converting on their way out. */
+static inline Bool
+scfbConvert(ScfbPtr fPtr)
+{
+	return fPtr->swizzle || fPtr->gamma;
+}
+
+/*
+ * Ways of storing rows to the framebuffer, the best depending on how it
+ * is mapped.  Rows needing a gather, when rotated, are gathered straight
+ * into the framebuffer by the first and into a scratch line first by the
+ * others, which only pay off on whole rows.
+ */
+static const struct {
+	const char *		name;
+	scfb_copy_proc		copy;
+	Bool			staged;
+} scfbKernels[] = {
+	{ "memcpy",	scfb_copy,		FALSE },
+	{ "stream",	scfb_copy_stream,	TRUE },
+	{ "words",	scfb_copy_words,	TRUE },
+};
+
+#define SCFB_KERNELS	(int)(sizeof(scfbKernels) / sizeof(scfbKernels[0]))
+
+/* Index of the kernel called name, or -1. */
+int
+ScfbFlushKernelLookup(const char *name)
+{
+	int i;
+
+	for (i = 0; i < SCFB_KERNELS; i++)
+		if (xf86NameCmp(name, scfbKernels[i].name) == 0)
+			return i;
+	return -1;
+}
+
+/*
+ * Store a row of n pixels to the framebuffer, in its channel order and
+ * gamma corrected.
+ */
+static void
+scfbPutRow(ScfbPtr fPtr, CARD8 *dst, const CARD8 *src, int n, int cpp)
+{
+	if (fPtr->gamma)
+		scfb_lut32((CARD32 *)dst, (const CARD32 *)src, n,
+		    fPtr->gammaLut);
+	else if (fPtr->swizzle)
+		scfb_swizzle32((CARD32 *)dst, (const CARD32 *)src, n,
+		    fPtr->fbOffset.red, fPtr->fbOffset.green,
+		    fPtr->fbOffset.blue);
+	else
+		scfbKernels[fPtr->flushKernel].copy(dst, src, n * cpp);
+}
+
+/*
+ * 16.16 source position sampled by framebuffer pixel u.  Bilinear
+ * sampling is relative to pixel centres.
+ */
+static int
+scfbSourcePos(ScfbPtr fPtr, int u, int limit, Bool bilinear)
+{
+	INT64 pos = (((INT64)2 * u + 1) * fPtr->scaleInv) >> 1;
+
+	if (bilinear)
+		pos -= 0x8000;
+	if (pos < 0)
+		pos = 0;
+	if (pos > ((INT64)(limit - 1) << 16))
+		pos = (INT64)(limit - 1) << 16;
+	return (int)pos;
+}
+
+static void
+scfbFlushBoxScaled(ScrnInfoPtr pScrn, const BoxRec *pbox)
+{
+	ScfbPtr fPtr = SCFBPTR(pScrn);
+	int cpp = pScrn->bitsPerPixel / 8;
+	int fbw = fPtr->info.vi_width, fbh = fPtr->info.vi_height;
+	Bool bilinear = (cpp == 4);
+	CARD8 *line0 = fPtr->flushLine;
+	CARD8 *line1 = line0 + fPtr->flushLineLen;
+	CARD8 *out = line1 + fPtr->flushLineLen;
+	CARD8 *row0, *dst;
+	int u1, u2, v1, v2, v, y, k, n, sx1, sx2, sy, sy0, sy1, fx, fy;
+	int prev0 = -1, prev1 = -1;
+	BoxRec rbox;
+
+	scfbXformBox(pScrn, pbox, &rbox);
+	if (rbox.x1 >= rbox.x2 || rbox.y1 >= rbox.y2)
+		return;
+
+	if ((fPtr->scale & 0xffff) == 0) {
+		/* Integer factor: every pixel becomes a k x k block. */
+		k = fPtr->scale >> 16;
+		n = rbox.x2 - rbox.x1;
+		u1 = rbox.x1 * k;
+		u2 = min(rbox.x2 * k, fbw);
+		for (y = rbox.y1; y < rbox.y2; y++) {
+			row0 = scfbFetchRow(pScrn, line0, rbox.x1, rbox.x2, y,
+			    TRUE);
+			scfb_scale_int(out, row0, n, k, cpp);
+			if (scfbConvert(fPtr))
+				scfbPutRow(fPtr, out, out, u2 - u1, cpp);
+			for (v = y * k; v < min((y + 1) * k, fbh); v++) {
+				dst = fPtr->fbmem + v * fPtr->linebytes +
+				    u1 * cpp;
+				scfbKernels[fPtr->flushKernel].copy(dst, out,
+				    (u2 - u1) * cpp);
+			}
+		}
+		return;
+	}
+
+	/* Fractional factor: widen by a pixel for the filter footprint. */
+	u1 = max((int)(((INT64)rbox.x1 * fPtr->scale) >> 16) - 1, 0);
+	u2 = min((int)((((INT64)rbox.x2 * fPtr->scale) + 0xffff) >> 16) + 1,
+	    fbw);
+	v1 = max((int)(((INT64)rbox.y1 * fPtr->scale) >> 16) - 1, 0);
+	v2 = min((int)((((INT64)rbox.y2 * fPtr->scale) + 0xffff) >> 16) + 1,
+	    fbh);
+	if (u1 >= u2 || v1 >= v2)
+		return;
+
+	fx = scfbSourcePos(fPtr, u1, fPtr->imgWidth, bilinear);
+	sx1 = fx >> 16;
+	sx2 = min((scfbSourcePos(fPtr, u2 - 1, fPtr->imgWidth, bilinear) >>
+	    16) + 1, fPtr->imgWidth - 1);
+	n = sx2 - sx1 + 1;
+	fx -= sx1 << 16;
+
+	for (v = v1; v < v2; v++) {
+		dst = fPtr->fbmem + v * fPtr->linebytes + u1 * cpp;
+		fy = scfbSourcePos(fPtr, v, fPtr->imgHeight, bilinear);
+		if (!bilinear) {
+			sy = fy >> 16;
+			if (sy != prev0) {
+				row0 = scfbFetchRow(pScrn, line0, sx1,
+				    sx1 + n, sy, TRUE);
+				scfb_scale_nearest(out, row0, u2 - u1, fx,
+				    fPtr->scaleInv, cpp);
+				if (scfbConvert(fPtr))
+					scfbPutRow(fPtr, out, out, u2 - u1,
+					    cpp);
+				prev0 = sy;
+			}
+			scfbKernels[fPtr->flushKernel].copy(dst, out,
+			    (u2 - u1) * cpp);
+			continue;
+		}
+
+		sy0 = fy >> 16;
+		sy1 = min(sy0 + 1, fPtr->imgHeight - 1);
+		if (sy0 == prev1 && sy0 != prev0) {
+			/* Moved down one source row: reuse the lower one. */
+			CARD8 *t = line0;
+
+			line0 = line1;
+			line1 = t;
+			prev0 = prev1;
+			prev1 = -1;
+		}
+		if (sy0 != prev0) {
+			scfbFetchRow(pScrn, line0, sx1, sx1 + n, sy0, FALSE);
+			memcpy(line0 + n * 4, line0 + (n - 1) * 4, 4);
+			prev0 = sy0;
+		}
+		if (sy1 != prev1) {
+			scfbFetchRow(pScrn, line1, sx1, sx1 + n, sy1, FALSE);
+			memcpy(line1 + n * 4, line1 + (n - 1) * 4, 4);
+			prev1 = sy1;
+		}
+		/* Converted on the way out, the framebuffer is not read. */
+		scfb_scale_bilinear32((CARD32 *)(scfbConvert(fPtr) ? out :
+		    dst), (CARD32 *)line0, (CARD32 *)line1, u2 - u1, fx,
+		    fPtr->scaleInv, (fy >> 8) & 0xff);
+		if (scfbConvert(fPtr))
+			scfbPutRow(fPtr, dst, out, u2 - u1, cpp);
+	}
+}
+
+/*
+ * Pack 8 bit shadow pixels into a 1 or 4 bpp framebuffer, a whole byte
+ * of the framebuffer at a time.
+ */
+static void
+scfbFlushBoxPacked(ScrnInfoPtr pScrn, const BoxRec *dbox)
+{
+	ScfbPtr fPtr = SCFBPTR(pScrn);
+	int ppb = 8 / fPtr->packDepth;
+	int u1 = dbox->x1 & ~(ppb - 1);
+	int u2 = min((dbox->x2 + ppb - 1) & ~(ppb - 1), fPtr->imgWidth);
+	CARD8 *src, *dst;
+	int v;
+
+	for (v = dbox->y1; v < dbox->y2; v++) {
+		src = scfbFetchRow(pScrn, fPtr->flushLine, u1, u2, v, TRUE);
+		dst = fPtr->fbmem + v * fPtr->linebytes + u1 / ppb;
+		if (fPtr->packDepth == 4)
+			scfb_pack4(dst, src, u2 - u1);
+		else if (fPtr->packThreshold >= 0)
+			scfb_pack1_threshold(dst, src, u2 - u1,
+			    fPtr->packThreshold, fPtr->packInvert);
+		else
+			scfb_pack1(dst, src, u2 - u1, fPtr->packLut);
+	}
+}
+
+/* Widen r5g6b5 shadow pixels into a 32 bpp framebuffer. */
+static void
+scfbFlushBoxExpand(ScrnInfoPtr pScrn, const BoxRec *dbox)
+{
+	ScfbPtr fPtr = SCFBPTR(pScrn);
+	CARD8 *src;
+	CARD32 *dst;
+	int v;
+
+	for (v = dbox->y1; v < dbox->y2; v++) {
+		src = scfbFetchRow(pScrn, fPtr->flushLine, dbox->x1, dbox->x2,
+		    v, TRUE);
+		dst = (CARD32 *)(fPtr->fbmem + v * fPtr->linebytes) +
+		    dbox->x1;
+		scfb_expand565(dst, (const CARD16 *)src, dbox->x2 - dbox->x1,
+		    fPtr->fbOffset.red, fPtr->fbOffset.green,
+		    fPtr->fbOffset.blue);
+	}
+}
+
+static void
+scfbFlushBox(ScrnInfoPtr pScrn, const BoxRec *pbox)
+{
+	ScfbPtr fPtr = SCFBPTR(pScrn);
+	ScfbXformPtr xf = &fPtr->xform;
+	int cpp = pScrn->bitsPerPixel / 8;
+	int spitch = fPtr->shadowPitch;
+	ptrdiff_t step = xf->xx * cpp + xf->yx * spitch;
+	BoxRec dbox;
+	int n, v, x, y;
+	CARD8 *src, *dst;
+
+	if (fPtr->scale != SCFB_SCALE_ONE) {
+		scfbFlushBoxScaled(pScrn, pbox);
+		return;
+	}
+
+	scfbXformBox(pScrn, pbox, &dbox);
+	if (dbox.x1 >= dbox.x2 || dbox.y1 >= dbox.y2)
+		return;
+	if (fPtr->packDepth != 0) {
+		scfbFlushBoxPacked(pScrn, &dbox);
+		return;
+	}
+	if (fPtr->expand) {
+		scfbFlushBoxExpand(pScrn, &dbox);
+		return;
+	}
+	n = dbox.x2 - dbox.x1;
+
+	for (v = dbox.y1; v < dbox.y2; v++) {
+		x = xf->xx * dbox.x1 + xf->xy * v + xf->x0;
+		y = xf->yx * dbox.x1 + xf->yy * v + xf->y0;
+		src = (CARD8 *)fPtr->shadow + y * spitch + x * cpp;
+		dst = fPtr->fbmem + v * fPtr->linebytes + dbox.x1 * cpp;
+		if (step == cpp)
+			scfbPutRow(fPtr, dst, src, n, cpp);
+		else if (scfbConvert(fPtr) ||
+		    scfbKernels[fPtr->flushKernel].staged) {
+			scfb_fetch_step(fPtr->flushLine, src, step, n, cpp);
+			scfbPutRow(fPtr, dst, fPtr->flushLine, n, cpp);
+		} else
+			scfb_fetch_step(dst, src, step, n, cpp);
+	}
+}
+
+static CARD64
+scfbNanos(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (CARD64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * Latency accounting.  The first damage after a flush, and the first
+ * pointer motion, are timestamped; the time until the flush that covers
+ * them completes goes into a histogram.  Bucket i < 8 holds i us, above
+ * that each octave is split into four buckets.
+ */
+static int
+scfbLatencyBucket(CARD32 us)
+{
+	int e;
+
+	if (us < 8)
+		return us;
+	for (e = 3; us >> (e + 1); e++)
+		;
+	return 8 + (e - 3) * 4 + ((us >> (e - 2)) & 3);
+}
+
+/* Largest value that goes into bucket i. */
+static CARD32
+scfbLatencyLimit(int i)
+{
+	CARD64 limit;
+	int e;
+
+	if (i < 8)
+		return i;
+	e = 3 + (i - 8) / 4;
+	limit = ((CARD64)(4 + (i - 8) % 4 + 1) << (e - 2)) - 1;
+	return limit > 0xffffffff ? 0xffffffff : limit;
+}
+
+static void
+scfbLatencySample(ScfbLatencyPtr lat, CARD64 ns)
+{
+	CARD64 us = ns / 1000;
+
+	if (us > 0xffffffff)
+		us = 0xffffffff;
+	lat->bucket[scfbLatencyBucket(us)]++;
+	lat->count++;
+	if (us > lat->max)
+		lat->max = us;
+}
+
+/* The flush begun for damage and input at these times is complete. */
+static void
+scfbLatencyAdd(ScfbPtr fPtr, CARD64 damageStart, CARD64 inputStart)
+{
+	CARD64 now;
+
+	if (damageStart == 0 && inputStart == 0)
+		return;
+	now = scfbNanos();
+	if (damageStart != 0)
+		scfbLatencySample(&fPtr->latDamage, now - damageStart);
+	if (inputStart != 0)
+		scfbLatencySample(&fPtr->latInput, now - inputStart);
+}
+
+static CARD32
+scfbLatencyPercentile(const ScfbLatencyRec *lat, int pct)
+{
+	CARD64 want, seen = 0;
+	int i;
+
+	if (lat->count == 0)
+		return 0;
+	want = ((CARD64)lat->count * pct + 99) / 100;
+	for (i = 0; i < SCFB_LATENCY_BUCKETS; i++) {
+		seen += lat->bucket[i];
+		if (seen >= want)
+			break;
+	}
+	return min(scfbLatencyLimit(i), lat->max);
+}
+
+/*
+ * Publish the histograms as the _SCFB_FLUSH_LATENCY property of the
+ * root window, at most once per statsInterval: the number of samples,
+ * p50, p99 and maximum in us, for damage and then for pointer motion.
+ */
+static void
+scfbLatencyPublish(ScrnInfoPtr pScrn)
+{
+	ScfbPtr fPtr = SCFBPTR(pScrn);
+	ScreenPtr pScreen = pScrn->pScreen;
+	CARD32 now = GetTimeInMillis(), value[8];
+	ScfbLatencyRec lat[2];
+	Atom atom;
+	int i;
+
+	if (pScreen->root == NULL ||
+	    now - fPtr->latencyPublished < fPtr->statsInterval)
+		return;
+	fPtr->latencyPublished = now;
+
+	if (fPtr->flushRunning)
+		pthread_mutex_lock(&fPtr->flushLock);
+	lat[0] = fPtr->latDamage;
+	lat[1] = fPtr->latInput;
+	if (fPtr->flushRunning)
+		pthread_mutex_unlock(&fPtr->flushLock);
+
+	for (i = 0; i < 2; i++) {
+		value[i * 4] = lat[i].count;
+		value[i * 4 + 1] = scfbLatencyPercentile(&lat[i], 50);
+		value[i * 4 + 2] = scfbLatencyPercentile(&lat[i], 99);
+		value[i * 4 + 3] = lat[i].max;
+	}
+	atom = MakeAtom(SCFB_LATENCY_PROPERTY,
+	    sizeof(SCFB_LATENCY_PROPERTY) - 1, TRUE);
+	dixChangeWindowProperty(serverClient, pScreen->root, atom, XA_INTEGER,
+	    32, PropModeReplace, 8, value, FALSE);
+}
+
+/*
+ * Publish the number of flushes begun by damage and by the backoff
+ * timer as the _SCFB_FLUSH_WAKEUPS property of the root window, so that
+ * an idle screen can be seen to cause none.
+ */
+static void
+scfbWakeupsPublish(ScrnInfoPtr pScrn)
+{
+	ScfbPtr fPtr = SCFBPTR(pScrn);
+	ScreenPtr pScreen = pScrn->pScreen;
+	CARD32 value[2];
+	Atom atom;
+
+	if (pScreen->root == NULL)
+		return;
+	value[0] = fPtr->statWakeups;
+	value[1] = fPtr->statTimerWakeups;
+	atom = MakeAtom(SCFB_WAKEUPS_PROPERTY,
+	    sizeof(SCFB_WAKEUPS_PROPERTY) - 1, TRUE);
+	dixChangeWindowProperty(serverClient, pScreen->root, atom, XA_INTEGER,
+	    32, PropModeReplace, 2, value, FALSE);
+}
+
+/*
+ * Box coalescing.  Copying a box costs a fixed amount, plus an amount per
+ * row and per byte, in picoseconds, measured at startup.  Where copying
+ * the bounding box of two boxes is estimated to be cheaper than copying
+ * both, they are merged.  Copying undamaged pixels is harmless: they
+ * hold the same values in the shadow and the framebuffer.
+ */
+#define SCFB_COALESCE_LOOKBACK	8
+
+static CARD64
+scfbBoxCost(ScfbPtr fPtr, const BoxRec *pbox, int cpp)
+{
+	CARD64 w = pbox->x2 - pbox->x1;
+	CARD64 h = pbox->y2 - pbox->y1;
+
+	return fPtr->costBox + h * fPtr->costRow + w * h * cpp * fPtr->costByte;
+}
+
+static void
+scfbBoxUnion(BoxPtr dst, const BoxRec *a, const BoxRec *b)
+{
+	dst->x1 = min(a->x1, b->x1);
+	dst->y1 = min(a->y1, b->y1);
+	dst->x2 = max(a->x2, b->x2);
+	dst->y2 = max(a->y2, b->y2);
+}
+
+static int
+scfbCoalesce(ScfbPtr fPtr, const BoxRec *in, int nin, BoxPtr out, int cpp)
+{
+	INT64 saving, best;
+	BoxRec m;
+	int i, j, k, nout = 0;
+
+	for (i = 0; i < nin; i++) {
+		best = -1;
+		k = -1;
+		for (j = nout - 1; j >= 0 && j >= nout - SCFB_COALESCE_LOOKBACK;
+		     j--) {
+			scfbBoxUnion(&m, &out[j], &in[i]);
+			saving = (INT64)(scfbBoxCost(fPtr, &out[j], cpp) +
+			    scfbBoxCost(fPtr, &in[i], cpp)) -
+			    (INT64)scfbBoxCost(fPtr, &m, cpp);
+			if (saving > best) {
+				best = saving;
+				k = j;
+			}
+		}
+		if (best >= 0)
+			scfbBoxUnion(&out[k], &out[k], &in[i]);
+		else
+			out[nout++] = in[i];
+	}
+	return nout;
+}
+
+/*
+ * Framebuffers that are not scanned out of memory, virtual ones or those
+ * behind USB, are sent whole every so often unless the kernel is told
+ * what changed.  The boxes of each flush are passed on in framebuffer
+ * pixels, SCFB_DIRTY_BATCH at a time, to the kernel where configure
+ * found FBIO_DIRTY and to the flush recording.
+ */
+#define SCFB_DIRTY_BATCH	64
+
+/* The framebuffer pixels a flush of the shadow box in may write. */
+static Bool
+scfbDirtyBox(ScrnInfoPtr pScrn, const BoxRec *in, BoxPtr out)
+{
+	ScfbPtr fPtr = SCFBPTR(pScrn);
+	int fbw = fPtr->info.vi_width, fbh = fPtr->info.vi_height;
+	int ppb;
+
+	scfbXformBox(pScrn, in, out);
+	if (out->x1 >= out->x2 || out->y1 >= out->y2)
+		return FALSE;
+	if (fPtr->scale != SCFB_SCALE_ONE) {
+		/* As widened by the scaler. */
+		out->x1 = max((int)(((INT64)out->x1 * fPtr->scale) >> 16) - 1,
+		    0);
+		out->y1 = max((int)(((INT64)out->y1 * fPtr->scale) >> 16) - 1,
+		    0);
+		out->x2 = min((int)((((INT64)out->x2 * fPtr->scale) +
+		    0xffff) >> 16) + 1, fbw);
+		out->y2 = min((int)((((INT64)out->y2 * fPtr->scale) +
+		    0xffff) >> 16) + 1, fbh);
+	} else if (fPtr->packDepth != 0) {
+		/* Whole bytes are written. */
+		ppb = 8 / fPtr->packDepth;
+		out->x1 &= ~(ppb - 1);
+		out->x2 = min((out->x2 + ppb - 1) & ~(ppb - 1), fbw);
+	}
+	return TRUE;
+}
+
+static void
+scfbDirtyNotify(ScrnInfoPtr pScrn, const BoxRec *pbox, int nbox)
+{
+	ScfbPtr fPtr = SCFBPTR(pScrn);
+	BoxRec rects[SCFB_DIRTY_BATCH];
+#ifdef HAVE_FBIO_DIRTY
+	struct fb_dirty_rect fbr[SCFB_DIRTY_BATCH];
+	struct fb_dirty dirty;
+	int i, r;
+#endif
+	int n;
+
+	/* Nothing is listening once the recording has stopped. */
+	if (!fPtr->dirtyIoctl && fPtr->recordFd == -1) {
+		fPtr->dirtyNotify = FALSE;
+		return;
+	}
+
+	while (nbox > 0) {
+		for (n = 0; nbox > 0 && n < SCFB_DIRTY_BATCH; nbox--, pbox++)
+			if (scfbDirtyBox(pScrn, pbox, &rects[n]))
+				n++;
+		if (n == 0)
+			break;
+#ifdef HAVE_FBIO_DIRTY
+		if (fPtr->dirtyIoctl) {
+			for (i = 0; i < n; i++) {
+				fbr[i].x1 = rects[i].x1;
+				fbr[i].y1 = rects[i].y1;
+				fbr[i].x2 = rects[i].x2;
+				fbr[i].y2 = rects[i].y2;
+			}
+			dirty.count = n;
+			dirty.rects = fbr;
+			do
+				r = ioctl(fPtr->fd, FBIO_DIRTY, &dirty);
+			while (r == -1 && errno == EINTR);
+			if (r == -1) {
+				xf86DrvMsg(pScrn->scrnIndex, X_WARNING,
+				    "ioctl FBIO_DIRTY: %s, no longer telling "
+				    "the kernel what changed\n",
+				    strerror(errno));
+				fPtr->dirtyIoctl = FALSE;
+				fPtr->dirtyNotify = FALSE;
+				return;
+			}
+		}
+#endif
+		ScfbRecordDirty(pScrn, rects, n);
+		fPtr->statDirtyCalls++;
+		fPtr->statDirtyRects += n;
+	}
+}
+
+/* Copy the given shadow region to the framebuffer, synchronously. */
+void
+ScfbFlushRegion(ScrnInfoPtr pScrn, RegionPtr pRegion)
+{
+	ScfbPtr fPtr = SCFBPTR(pScrn);
+	BoxPtr pbox = RegionRects(pRegion);
+	int nbox = RegionNumRects(pRegion);
+	int cpp = pScrn->bitsPerPixel / 8;
+	CARD64 start, est;
+	RegionRec visible;
+	BoxPtr boxes;
+	BoxRec view;
+	int i;
+
+	/* Damage outside the viewport is copied once it is panned to. */
+	if (fPtr->panning) {
+		view.x1 = fPtr->viewX;
+		view.y1 = fPtr->viewY;
+		view.x2 = fPtr->viewX + fPtr->viewWidth;
+		view.y2 = fPtr->viewY + fPtr->viewHeight;
+		RegionInit(&visible, &view, 1);
+		RegionIntersect(&visible, &visible, pRegion);
+		pbox = RegionRects(&visible);
+		nbox = RegionNumRects(&visible);
+	}
+
+	fPtr->statBoxesIn += nbox;
+	if (fPtr->coalesce && nbox > 1) {
+		if (nbox > fPtr->flushBoxesLen) {
+			boxes = realloc(fPtr->flushBoxes, nbox * sizeof(BoxRec));
+			if (boxes != NULL) {
+				fPtr->flushBoxes = boxes;
+				fPtr->flushBoxesLen = nbox;
+			}
+		}
+		if (nbox <= fPtr->flushBoxesLen) {
+			nbox = scfbCoalesce(fPtr, pbox, nbox, fPtr->flushBoxes,
+			    cpp);
+			pbox = fPtr->flushBoxes;
+		}
+	}
+	fPtr->statBoxesOut += nbox;
+
+	est = 0;
+	for (i = 0; i < nbox; i++) {
+		est += scfbBoxCost(fPtr, &pbox[i], cpp);
+		fPtr->statPixels += (CARD64)(pbox[i].x2 - pbox[i].x1) *
+		    (pbox[i].y2 - pbox[i].y1);
+	}
+	start = scfbNanos();
+	for (i = 0; i < nbox; i++)
+		scfbFlushBox(pScrn, &pbox[i]);
+	fPtr->statActualNs += scfbNanos() - start;
+	fPtr->statEstNs += est / 1000;
+
+	ScfbExportDamage(pScrn, pRegion);
+	ScfbRecordFlush(pScrn, pRegion);
+	if (fPtr->dirtyNotify)
+		scfbDirtyNotify(pScrn, pbox, nbox);
+	if (fPtr->panning)
+		RegionUninit(&visible);
+}
+
+/*
+ * Fit the cost model by timing flushes of many single pixels, of full
+ * height columns and of the whole screen.  Done before anything is shown,
+ * the shadow is still blank.
+ */
+void
+ScfbFlushCalibrate(ScrnInfoPtr pScrn)
+{
+	ScfbPtr fPtr = SCFBPTR(pScrn);
+	int cpp = pScrn->bitsPerPixel / 8;
+	CARD64 w = fPtr->viewWidth, h = fPtr->viewHeight;
+	CARD64 start, t;
+	double box, col, full, row, byte;
+	BoxRec b;
+	int i;
+
+	start = scfbNanos();
+	for (i = 0; i < 4096; i++) {
+		b.x1 = (i * 7919) % w;
+		b.y1 = (i * 104729) % h;
+		b.x2 = b.x1 + 1;
+		b.y2 = b.y1 + 1;
+		scfbFlushBox(pScrn, &b);
+	}
+	box = (double)(scfbNanos() - start) / 4096;
+
+	start = scfbNanos();
+	for (i = 0; i < 16; i++) {
+		b.x1 = (i * w) / 16;
+		b.x2 = b.x1 + 1;
+		b.y1 = 0;
+		b.y2 = h;
+		scfbFlushBox(pScrn, &b);
+	}
+	col = (double)(scfbNanos() - start) / 16;
+
+	b.x1 = b.y1 = 0;
+	b.x2 = w;
+	b.y2 = h;
+	start = scfbNanos();
+	for (i = 0; i < 2; i++)
+		scfbFlushBox(pScrn, &b);
+	t = scfbNanos() - start;
+	full = (double)t / 2;
+
+	byte = w > 1 ? (full - col) / ((w - 1) * h * cpp) : 0;
+	if (byte < 0)
+		byte = 0;
+	row = (col - box - h * cpp * byte) / h;
+	if (row < 0)
+		row = 0;
+
+	fPtr->costBox = box * 1000;
+	fPtr->costRow = row * 1000;
+	fPtr->costByte = byte * 1000 + 0.5;
+	xf86DrvMsg(pScrn->scrnIndex, X_INFO, "Flush cost model: %u ns per "
+	    "box, %u ps per row, %u ps per byte\n",
+	    (unsigned)(fPtr->costBox / 1000), (unsigned)fPtr->costRow,
+	    (unsigned)fPtr->costByte);
+}
+
+/* Whether the flush stores rows through one of scfbKernels. */
+static Bool
+scfbKernelUsed(ScrnInfoPtr pScrn)
+{
+	ScfbPtr fPtr = SCFBPTR(pScrn);
+
+	if (fPtr->packDepth != 0 || fPtr->expand)
+		return FALSE;
+	if (fPtr->scale == SCFB_SCALE_ONE)
+		return !scfbConvert(fPtr);
+	/* Bilinear scaling stores what it filters. */
+	return (fPtr->scale & 0xffff) == 0 || pScrn->bitsPerPixel != 32;
+}
+
+#define SCFB_AUTOTUNE_NS	(50 * 1000000)
+#define SCFB_AUTOTUNE_BYTES	(256 * 1024)
+#define SCFB_AUTOTUNE_ROUNDS	16
+
+/*
+ * Pick the fastest way of storing rows on this mapping, unless pinned,
+ * by flushing a band of the screen with each in turn, for a bounded
+ * time.  The shadow is flushed as it is, so what is shown stays right.
+ */
+void
+ScfbFlushAutotune(ScrnInfoPtr pScrn)
+{
+	ScfbPtr fPtr = SCFBPTR(pScrn);
+	int cpp = max(pScrn->bitsPerPixel / 8, 1);
+	CARD64 best[SCFB_KERNELS], start, end, t;
+	char times[32 * SCFB_KERNELS];
+	size_t len = 0;
+	BoxRec b;
+	int i, round;
+
+	if (fPtr->kernelPinned || !scfbKernelUsed(pScrn))
+		return;
+
+	b.x1 = b.y1 = 0;
+	b.x2 = fPtr->viewWidth;
+	b.y2 = SCFB_AUTOTUNE_BYTES / (fPtr->viewWidth * cpp);
+	b.y2 = max(min(b.y2, fPtr->viewHeight), 1);
+	for (i = 0; i < SCFB_KERNELS; i++)
+		best[i] = ~(CARD64)0;
+	/* In turns, so that all see the same conditions. */
+	end = scfbNanos() + SCFB_AUTOTUNE_NS;
+	for (round = 0; round < SCFB_AUTOTUNE_ROUNDS; round++) {
+		for (i = 0; i < SCFB_KERNELS; i++) {
+			fPtr->flushKernel = i;
+			start = scfbNanos();
+			scfbFlushBox(pScrn, &b);
+			t = scfbNanos() - start;
+			best[i] = min(best[i], t);
+		}
+		if (scfbNanos() >= end)
+			break;
+	}
+
+	fPtr->flushKernel = 0;
+	for (i = 0; i < SCFB_KERNELS; i++) {
+		if (best[i] < best[fPtr->flushKernel])
+			fPtr->flushKernel = i;
+		len += snprintf(times + len, sizeof(times) - len, "%s%s %llu us",
+		    i > 0 ? ", " : "", scfbKernels[i].name,
+		    (unsigned long long)(best[i] / 1000));
+	}
+	xf86DrvMsg(pScrn->scrnIndex, X_INFO, "Flush kernel: %s, timed over "
+	    "%d rows (%s)\n", scfbKernels[fPtr->flushKernel].name, b.y2,
+	    times);
+}
+
+void
+ScfbFlushReport(ScrnInfoPtr pScrn)
+{
+	ScfbPtr fPtr = SCFBPTR(pScrn);
+
+	if (fPtr->shadowFB)
+		xf86DrvMsg(pScrn->scrnIndex, X_INFO, "Flushes begun by "
+		    "damage: %u, by the backoff timer: %u\n",
+		    (unsigned)fPtr->statWakeups,
+		    (unsigned)fPtr->statTimerWakeups);
+	if (fPtr->statBoxesIn == 0)
+		return;
+	xf86DrvMsg(pScrn->scrnIndex, X_INFO, "Flushed %llu boxes as %llu, "
+	    "%llu ms estimated, %llu ms taken\n",
+	    (unsigned long long)fPtr->statBoxesIn,
+	    (unsigned long long)fPtr->statBoxesOut,
+	    (unsigned long long)(fPtr->statEstNs / 1000000),
+	    (unsigned long long)(fPtr->statActualNs / 1000000));
+	if (fPtr->statActualNs > 0)
+		xf86DrvMsg(pScrn->scrnIndex, X_INFO, "Flushed %llu Mpixels "
+		    "at %llu Mpixels/s\n",
+		    (unsigned long long)(fPtr->statPixels / 1000000),
+		    (unsigned long long)(fPtr->statPixels * 1000 /
+		    fPtr->statActualNs));
+	if (fPtr->statDeferredTicks > 0)
+		xf86DrvMsg(pScrn->scrnIndex, X_INFO, "Flushes over budget "
+		    "left %llu kB for later in %u ticks, damage waited up to "
+		    "%u ms\n", (unsigned long long)(fPtr->statDeferredBytes /
+		    1024), (unsigned)fPtr->statDeferredTicks,
+		    (unsigned)fPtr->statStaleMax);
+	if (fPtr->statDirtyCalls > 0)
+		xf86DrvMsg(pScrn->scrnIndex, X_INFO, "Passed on %llu changed "
+		    "rectangles in %llu calls\n",
+		    (unsigned long long)fPtr->statDirtyRects,
+		    (unsigned long long)fPtr->statDirtyCalls);
+}
+
+static void *
+scfbFlushWorker(void *arg)
+{
+	ScrnInfoPtr pScrn = arg;
+	ScfbPtr fPtr = SCFBPTR(pScrn);
+	CARD64 damageStart, inputStart;
+	RegionRec work;
+
+	RegionNull(&work);
+	pthread_mutex_lock(&fPtr->flushLock);
+	for (;;) {
+		while (!fPtr->flushQuit && !RegionNotEmpty(&fPtr->flushPending)) {
+			fPtr->flushBusy = FALSE;
+			pthread_cond_broadcast(&fPtr->flushIdle);
+			pthread_cond_wait(&fPtr->flushCond, &fPtr->flushLock);
+		}
+		if (fPtr->flushQuit)
+			break;
+		RegionCopy(&work, &fPtr->flushPending);
+		RegionEmpty(&fPtr->flushPending);
+		damageStart = fPtr->pendingDamageStart;
+		inputStart = fPtr->pendingInputStart;
+		fPtr->pendingDamageStart = fPtr->pendingInputStart = 0;
+		fPtr->flushBusy = TRUE;
+		pthread_mutex_unlock(&fPtr->flushLock);
+
+		ScfbFlushRegion(pScrn, &work);
+
+		pthread_mutex_lock(&fPtr->flushLock);
+		scfbLatencyAdd(fPtr, damageStart, inputStart);
+	}
+	fPtr->flushBusy = FALSE;
+	pthread_cond_broadcast(&fPtr->flushIdle);
+	pthread_mutex_unlock(&fPtr->flushLock);
+	RegionUninit(&work);
+	return NULL;
+}
+
+Bool
+ScfbFlushStart(ScrnInfoPtr pScrn)
+{
+	ScfbPtr fPtr = SCFBPTR(pScrn);
+	int err;
+
+	if (!fPtr->flushThreaded || fPtr->flushRunning)
+		return TRUE;
+
+	RegionNull(&fPtr->flushPending);
+	pthread_mutex_init(&fPtr->flushLock, NULL);
+	pthread_cond_init(&fPtr->flushCond, NULL);
+	pthread_cond_init(&fPtr->flushIdle, NULL);
+	fPtr->flushQuit = FALSE;
+	fPtr->flushBusy = FALSE;
+
+	err = pthread_create(&fPtr->flushThread, NULL, scfbFlushWorker, pScrn);
+	if (err != 0) {
+		xf86DrvMsg(pScrn->scrnIndex, X_WARNING,
+		    "Cannot start flush thread: %s. Flushing synchronously.\n",
+		    strerror(err));
+		fPtr->flushThreaded = FALSE;
+		pthread_cond_destroy(&fPtr->flushIdle);
+		pthread_cond_destroy(&fPtr->flushCond);
+		pthread_mutex_destroy(&fPtr->flushLock);
+		RegionUninit(&fPtr->flushPending);
+		return TRUE;
+	}
+	fPtr->flushRunning = TRUE;
+
+#ifdef __FreeBSD__
+	if (fPtr->flushCPU >= 0) {
+		cpuset_t set;
+
+		CPU_ZERO(&set);
+		CPU_SET(fPtr->flushCPU, &set);
+		err = pthread_setaffinity_np(fPtr->flushThread, sizeof(set),
+		    &set);
+		if (err != 0)
+			xf86DrvMsg(pScrn->scrnIndex, X_WARNING,
+			    "Cannot bind flush thread to CPU %d: %s\n",
+			    fPtr->flushCPU, strerror(err));
+	}
+#endif
+	xf86DrvMsg(pScrn->scrnIndex, X_INFO, "Started flush thread%s\n",
+	    fPtr->flushCPU >= 0 ? " (pinned)" : "");
+	return TRUE;
+}
+
+/* Drain pending work and stop the worker. */
+void
+ScfbFlushStop(ScrnInfoPtr pScrn)
+{
+	ScfbPtr fPtr = SCFBPTR(pScrn);
+
+	if (!fPtr->flushRunning)
+		return;
+
+	ScfbFlushSync(pScrn);
+	pthread_mutex_lock(&fPtr->flushLock);
+	fPtr->flushQuit = TRUE;
+	pthread_cond_signal(&fPtr->flushCond);
+	pthread_mutex_unlock(&fPtr->flushLock);
+	pthread_join(fPtr->flushThread, NULL);
+
+	RegionUninit(&fPtr->flushPending);
+	pthread_cond_destroy(&fPtr->flushIdle);
+	pthread_cond_destroy(&fPtr->flushCond);
+	pthread_mutex_destroy(&fPtr->flushLock);
+	fPtr->flushRunning = FALSE;
+}
+
+/* Hand a region to the worker, or flush it now. */
+static void
+scfbFlushDispatch(ScrnInfoPtr pScrn, RegionPtr pRegion)
+{
+	ScfbPtr fPtr = SCFBPTR(pScrn);
+	CARD64 damageStart = fPtr->damageStart;
+	CARD64 inputStart = fPtr->inputStart;
+
+	fPtr->damageStart = fPtr->inputStart = 0;
+	if (fPtr->flushRunning) {
+		pthread_mutex_lock(&fPtr->flushLock);
+		RegionUnion(&fPtr->flushPending, &fPtr->flushPending, pRegion);
+		if (fPtr->pendingDamageStart == 0)
+			fPtr->pendingDamageStart = damageStart;
+		if (fPtr->pendingInputStart == 0)
+			fPtr->pendingInputStart = inputStart;
+		pthread_cond_signal(&fPtr->flushCond);
+		pthread_mutex_unlock(&fPtr->flushLock);
+	} else {
+		ScfbFlushRegion(pScrn, pRegion);
+		scfbLatencyAdd(fPtr, damageStart, inputStart);
+	}
+}
+
+/*
+ * Time budgeted flushing.  Flushing a screen full of damage can take
+ * tens of milliseconds, while what the user is interacting with waits
+ * like the rest.  With a budget, each tick flushes the damage near the
+ * pointer and in the focused window first, then the rest oldest first,
+ * until the cost model says the budget is spent.  What is left waits in
+ * bands by age for the next tick, which a timer brings if damage does
+ * not.  With the worker, a tick waits for the previous one to be done.
+ */
+#define SCFB_SCHED_NEAR		64	/* Pixels around the pointer. */
+#define SCFB_SCHED_TICK		1	/* ms between ticks when behind. */
+
+/* Where the user is looking: around the pointer and the focus. */
+static void
+scfbSchedNear(ScrnInfoPtr pScrn, RegionPtr pNear)
+{
+	ScfbPtr fPtr = SCFBPTR(pScrn);
+	DeviceIntPtr kbd = inputInfo.keyboard;
+	WindowPtr pWin = NoneWin;
+	BoxRec box;
+
+	box.x1 = fPtr->pointerX - SCFB_SCHED_NEAR;
+	box.y1 = fPtr->pointerY - SCFB_SCHED_NEAR;
+	box.x2 = fPtr->pointerX + SCFB_SCHED_NEAR;
+	box.y2 = fPtr->pointerY + SCFB_SCHED_NEAR;
+	RegionInit(pNear, &box, 1);
+
+	if (kbd != NULL && kbd->focus != NULL)
+		pWin = kbd->focus->win;
+	if (pWin != NoneWin && pWin != PointerRootWin &&
+	    pWin != FollowKeyboardWin && pWin->viewable)
+		RegionUnion(pNear, pNear, &pWin->borderClip);
+}
+
+/*
+ * Add boxes of pFrom to pOut while the budget, in ps, lasts.  A box that
+ * does not fit is cut to the rows that do; a row at least is taken while
+ * pOut is empty, so that every tick gets somewhere.  Returns whether all
+ * of pFrom was taken.
+ */
+static Bool
+scfbSchedTake(ScrnInfoPtr pScrn, RegionPtr pFrom, RegionPtr pOut,
+	      CARD64 *budget)
+{
+	ScfbPtr fPtr = SCFBPTR(pScrn);
+	int cpp = max(pScrn->bitsPerPixel / 8, 1);
+	BoxPtr pbox = RegionRects(pFrom);
+	int nbox = RegionNumRects(pFrom), i, rows;
+	CARD64 cost = 0, row;
+	RegionRec taken, one;
+	BoxRec part;
+	Bool overlap;
+
+	for (i = 0; i < nbox; i++)
+		cost += scfbBoxCost(fPtr, &pbox[i], cpp);
+	if (cost <= *budget) {
+		*budget -= cost;
+		RegionUnion(pOut, pOut, pFrom);
+		return TRUE;
+	}
+
+	RegionNull(&taken);
+	for (; nbox > 0; nbox--, pbox++) {
+		part = *pbox;
+		cost = scfbBoxCost(fPtr, &part, cpp);
+		if (cost > *budget) {
+			row = fPtr->costRow +
+			    (CARD64)(part.x2 - part.x1) * cpp * fPtr->costByte;
+			rows = *budget > fPtr->costBox ?
+			    (*budget - fPtr->costBox) / max(row, 1) : 0;
+			if (rows == 0 && (RegionNotEmpty(pOut) ||
+			    RegionNotEmpty(&taken)))
+				break;
+			part.y2 = min(part.y1 + max(rows, 1), part.y2);
+			cost = *budget;
+		}
+		RegionInit(&one, &part, 1);
+		RegionAppend(&taken, &one);
+		RegionUninit(&one);
+		*budget -= cost;
+		if (part.y2 != pbox->y2)
+			break;
+	}
+	RegionValidate(&taken, &overlap);
+	RegionUnion(pOut, pOut, &taken);
+	RegionUninit(&taken);
+	return FALSE;
+}
+
+static CARD32 scfbSchedTimer(OsTimerPtr, CARD32, void *);
+
+/*
+ * Flush what the budget allows, or everything if all is set, and arm
+ * the timer for what is left.
+ */
+static void
+scfbSchedTick(ScrnInfoPtr pScrn, Bool all)
+{
+	ScfbPtr fPtr = SCFBPTR(pScrn);
+	CARD64 budget = all ? ~(CARD64)0 : (CARD64)fPtr->flushBudget * 1000000;
+	CARD32 now = GetTimeInMillis();
+	RegionRec out, near, part;
+	BoxPtr pbox;
+	Bool more = TRUE, busy = FALSE;
+	int i, j, nbox;
+
+	if (fPtr->schedTimerArmed) {
+		TimerCancel(fPtr->schedTimer);
+		fPtr->schedTimerArmed = FALSE;
+	}
+	if (fPtr->schedBands == 0)
+		return;
+	if (fPtr->flushRunning && !all) {
+		pthread_mutex_lock(&fPtr->flushLock);
+		busy = fPtr->flushBusy ||
+		    RegionNotEmpty(&fPtr->flushPending);
+		pthread_mutex_unlock(&fPtr->flushLock);
+	}
+
+	if (!busy) {
+		fPtr->statStaleMax = max(fPtr->statStaleMax,
+		    now - fPtr->schedTime[0]);
+		RegionNull(&out);
+		if (!all) {
+			scfbSchedNear(pScrn, &near);
+			RegionNull(&part);
+			for (i = 0; i < fPtr->schedBands && more; i++) {
+				RegionIntersect(&part, &fPtr->schedBand[i],
+				    &near);
+				more = scfbSchedTake(pScrn, &part, &out,
+				    &budget);
+			}
+			RegionUninit(&part);
+			RegionUninit(&near);
+		}
+		for (i = 0; i < fPtr->schedBands && more; i++) {
+			RegionSubtract(&fPtr->schedBand[i],
+			    &fPtr->schedBand[i], &out);
+			more = scfbSchedTake(pScrn, &fPtr->schedBand[i], &out,
+			    &budget);
+		}
+
+		/* Drop what was taken, and the bands left empty. */
+		for (i = j = 0; i < fPtr->schedBands; i++) {
+			RegionSubtract(&fPtr->schedBand[i],
+			    &fPtr->schedBand[i], &out);
+			if (!RegionNotEmpty(&fPtr->schedBand[i])) {
+				RegionUninit(&fPtr->schedBand[i]);
+				continue;
+			}
+			fPtr->schedBand[j] = fPtr->schedBand[i];
+			fPtr->schedTime[j++] = fPtr->schedTime[i];
+		}
+		fPtr->schedBands = j;
+		if (RegionNotEmpty(&out))
+			scfbFlushDispatch(pScrn, &out);
+		RegionUninit(&out);
+	}
+
+	fPtr->schedBytes = 0;
+	for (i = 0; i < fPtr->schedBands; i++) {
+		pbox = RegionRects(&fPtr->schedBand[i]);
+		nbox = RegionNumRects(&fPtr->schedBand[i]);
+		for (; nbox > 0; nbox--, pbox++)
+			fPtr->schedBytes += (CARD64)(pbox->x2 - pbox->x1) *
+			    (pbox->y2 - pbox->y1) * pScrn->bitsPerPixel / 8;
+	}
+	if (fPtr->schedBands == 0)
+		return;
+	if (!busy) {
+		fPtr->statDeferredBytes += fPtr->schedBytes;
+		fPtr->statDeferredTicks++;
+	}
+	fPtr->schedTimer = TimerSet(fPtr->schedTimer, 0, SCFB_SCHED_TICK,
+	    scfbSchedTimer, pScrn);
+	fPtr->schedTimerArmed = TRUE;
+}
+
+/*
+ * Publish the bytes left for later, the ticks that left some, the kB
+ * left summed over them and the longest damage waited in ms, as the
+ * _SCFB_FLUSH_DEFERRED property of the root window, at most once per
+ * statsInterval.
+ */
+static void
+scfbSchedPublish(ScrnInfoPtr pScrn)
+{
+	ScfbPtr fPtr = SCFBPTR(pScrn);
+	ScreenPtr pScreen = pScrn->pScreen;
+	CARD32 now = GetTimeInMillis(), value[4];
+	Atom atom;
+
+	if (pScreen->root == NULL ||
+	    now - fPtr->schedPublished < fPtr->statsInterval)
+		return;
+	fPtr->schedPublished = now;
+
+	value[0] = min(fPtr->schedBytes, 0xffffffff);
+	value[1] = fPtr->statDeferredTicks;
+	value[2] = min(fPtr->statDeferredBytes / 1024, 0xffffffff);
+	value[3] = fPtr->statStaleMax;
+	atom = MakeAtom(SCFB_DEFERRED_PROPERTY,
+	    sizeof(SCFB_DEFERRED_PROPERTY) - 1, TRUE);
+	dixChangeWindowProperty(serverClient, pScreen->root, atom, XA_INTEGER,
+	    32, PropModeReplace, 4, value, FALSE);
+}
+
+static CARD32
+scfbSchedTimer(OsTimerPtr timer, CARD32 now, void *arg)
+{
+	ScrnInfoPtr pScrn = arg;
+	ScfbPtr fPtr = SCFBPTR(pScrn);
+
+	fPtr->schedTimerArmed = FALSE;
+	if (pScrn->vtSema && !fPtr->dgaActive && !fPtr->bypass) {
+		scfbSchedTick(pScrn, FALSE);
+		scfbSchedPublish(pScrn);
+	}
+	return 0;
+}
+
+/* Queue new damage, as a band of its own unless all are in use. */
+static void
+scfbSchedAdd(ScrnInfoPtr pScrn, RegionPtr pRegion)
+{
+	ScfbPtr fPtr = SCFBPTR(pScrn);
+	RegionRec fresh;
+	int i;
+
+	/* What already waits is flushed as it is by then. */
+	RegionNull(&fresh);
+	RegionCopy(&fresh, pRegion);
+	for (i = 0; i < fPtr->schedBands; i++)
+		RegionSubtract(&fresh, &fresh, &fPtr->schedBand[i]);
+	if (!RegionNotEmpty(&fresh)) {
+		RegionUninit(&fresh);
+		return;
+	}
+	if (fPtr->schedBands == SCFB_SCHED_BANDS) {
+		i = fPtr->schedBands - 1;
+		RegionUnion(&fPtr->schedBand[i], &fPtr->schedBand[i], &fresh);
+		RegionUninit(&fresh);
+		return;
+	}
+	fPtr->schedBand[fPtr->schedBands] = fresh;
+	fPtr->schedTime[fPtr->schedBands++] = GetTimeInMillis();
+}
+
+/* Flush a region, within the budget if there is one. */
+static void
+scfbFlushSubmit(ScrnInfoPtr pScrn, RegionPtr pRegion)
+{
+	ScfbPtr fPtr = SCFBPTR(pScrn);
+
+	if (fPtr->flushBudget == 0) {
+		scfbFlushDispatch(pScrn, pRegion);
+		return;
+	}
+	scfbSchedAdd(pScrn, pRegion);
+	scfbSchedTick(pScrn, FALSE);
+}
+
+void
+ScfbBudgetStart(ScrnInfoPtr pScrn)
+{
+	ScfbPtr fPtr = SCFBPTR(pScrn);
+
+	fPtr->schedBands = 0;
+	fPtr->schedBytes = 0;
+}
+
+/* Called once nothing more can be flushed. */
+void
+ScfbBudgetStop(ScrnInfoPtr pScrn)
+{
+	ScfbPtr fPtr = SCFBPTR(pScrn);
+	int i;
+
+	TimerFree(fPtr->schedTimer);
+	fPtr->schedTimer = NULL;
+	fPtr->schedTimerArmed = FALSE;
+	for (i = 0; i < fPtr->schedBands; i++)
+		RegionUninit(&fPtr->schedBand[i]);
+	fPtr->schedBands = 0;
+}
+
+/*
+ * Flush backoff.  Nothing here runs unless there is damage: the shadow
+ * layer only calls ScfbShadowUpdate from its BlockHandler when something
+ * was drawn, and the timer is one-shot, armed only while damage waits.
+ * Small damage arriving soon after the previous flush, without pointer
+ * motion, such as a blinking cursor or a clock, is held back for a
+ * delay that doubles up to backoffMax while it keeps coming.  Anything
+ * larger, and pointer motion, flushes everything at once.
+ */
+#define SCFB_BACKOFF_MIN	16
+#define SCFB_BACKOFF_AREA	(64 * 64)
+
+static void
+scfbFlushDeferred(ScrnInfoPtr pScrn)
+{
+	ScfbPtr fPtr = SCFBPTR(pScrn);
+
+	if (fPtr->flushTimerArmed) {
+		TimerCancel(fPtr->flushTimer);
+		fPtr->flushTimerArmed = FALSE;
+	}
+	if (RegionNotEmpty(&fPtr->flushDeferred)) {
+		scfbFlushSubmit(pScrn, &fPtr->flushDeferred);
+		RegionEmpty(&fPtr->flushDeferred);
+	}
+	fPtr->lastFlush = GetTimeInMillis();
+}
+
+static CARD32
+scfbFlushTimer(OsTimerPtr timer, CARD32 now, void *arg)
+{
+	ScrnInfoPtr pScrn = arg;
+	ScfbPtr fPtr = SCFBPTR(pScrn);
+
+	fPtr->flushTimerArmed = FALSE;
+	fPtr->statTimerWakeups++;
+	if (pScrn->vtSema && !fPtr->dgaActive && !fPtr->bypass) {
+		scfbFlushDeferred(pScrn);
+		scfbWakeupsPublish(pScrn);
+	}
+	return 0;
+}
+
+static void
+scfbFlushSchedule(ScrnInfoPtr pScrn, RegionPtr pRegion)
+{
+	ScfbPtr fPtr = SCFBPTR(pScrn);
+	BoxPtr pbox = RegionRects(pRegion);
+	int nbox = RegionNumRects(pRegion);
+	CARD32 area = 0;
+	Bool small;
+
+	for (; nbox > 0 && area <= SCFB_BACKOFF_AREA; nbox--, pbox++)
+		area += (pbox->x2 - pbox->x1) * (pbox->y2 - pbox->y1);
+	small = area <= SCFB_BACKOFF_AREA && !fPtr->inputSeen;
+	fPtr->inputSeen = FALSE;
+
+	RegionUnion(&fPtr->flushDeferred, &fPtr->flushDeferred, pRegion);
+	if (!small) {
+		fPtr->backoff = 0;
+		scfbFlushDeferred(pScrn);
+		return;
+	}
+	if (fPtr->flushTimerArmed)
+		return;
+
+	if (GetTimeInMillis() - fPtr->lastFlush < fPtr->backoffMax)
+		fPtr->backoff = fPtr->backoff == 0 ? SCFB_BACKOFF_MIN :
+		    min(fPtr->backoff * 2, fPtr->backoffMax);
+	else
+		fPtr->backoff = 0;
+	if (fPtr->backoff == 0) {
+		scfbFlushDeferred(pScrn);
+		return;
+	}
+	fPtr->flushTimer = TimerSet(fPtr->flushTimer, 0, fPtr->backoff,
+	    scfbFlushTimer, pScrn);
+	fPtr->flushTimerArmed = TRUE;
+}
+
+void
+ScfbBackoffStart(ScrnInfoPtr pScrn)
+{
+	ScfbPtr fPtr = SCFBPTR(pScrn);
+
+	if (fPtr->backoffMax == 0)
+		return;
+	RegionNull(&fPtr->flushDeferred);
+	fPtr->backoff = 0;
+	fPtr->lastFlush = GetTimeInMillis();
+}
+
+/* Called once nothing more can be flushed. */
+void
+ScfbBackoffStop(ScrnInfoPtr pScrn)
+{
+	ScfbPtr fPtr = SCFBPTR(pScrn);
+
+	if (fPtr->backoffMax == 0)
+		return;
+	TimerFree(fPtr->flushTimer);
+	fPtr->flushTimer = NULL;
+	fPtr->flushTimerArmed = FALSE;
+	RegionUninit(&fPtr->flushDeferred);
+}
+
+/*
+ * Wait until everything handed to the worker, or held back, reached the
+ * framebuffer.
+ */
+void
+ScfbFlushSync(ScrnInfoPtr pScrn)
+{
+	ScfbPtr fPtr = SCFBPTR(pScrn);
+
+	if (fPtr->backoffMax > 0 && pScrn->vtSema &&
+	    RegionNotEmpty(&fPtr->flushDeferred))
+		scfbFlushDeferred(pScrn);
+	if (fPtr->flushBudget > 0 && pScrn->vtSema)
+		scfbSchedTick(pScrn, TRUE);
+	if (!fPtr->flushRunning)
+		return;
+
+	pthread_mutex_lock(&fPtr->flushLock);
+	while (fPtr->flushBusy || RegionNotEmpty(&fPtr->flushPending))
+		pthread_cond_wait(&fPtr->flushIdle, &fPtr->flushLock);
+	pthread_mutex_unlock(&fPtr->flushLock);
+}
+
+/*
+ * Full screen bypass.  While one window of the screen pixmap covers the
+ * whole screen, the screen pixmap is pointed at the framebuffer itself,
+ * so that it is drawn once instead of drawn and then copied.  This needs
+ * the framebuffer to be laid out exactly like the shadow.
+ */
+static Bool
+scfbBypassWanted(ScreenPtr pScreen)
+{
+	ScrnInfoPtr pScrn = xf86ScreenToScrn(pScreen);
+	ScfbPtr fPtr = SCFBPTR(pScrn);
+	WindowPtr pWin;
+	BoxRec box;
+
+	if (!fPtr->bypassAllowed || !pScrn->vtSema ||
+	    pScreen->root == NULL || fPtr->rotate != SCFB_ROTATE_NONE ||
+	    fPtr->rrRotation != RR_Rotate_0 ||
+	    fPtr->scale != SCFB_SCALE_ONE || fPtr->exportMap != NULL ||
+	    fPtr->swizzle || fPtr->gamma || fPtr->packDepth != 0 ||
+	    fPtr->expand || fPtr->panning || fPtr->recordFd != -1 ||
+	    fPtr->dirtyNotify || fPtr->shadowPitch != fPtr->linebytes)
+		return FALSE;
+
+	/* The topmost window that can be seen, and not redirected. */
+	for (pWin = pScreen->root->firstChild; pWin; pWin = pWin->nextSib)
+		if (pWin->viewable && pWin->drawable.class == InputOutput)
+			break;
+	if (pWin == NULL || pScreen->GetWindowPixmap(pWin) !=
+	    pScreen->GetScreenPixmap(pScreen))
+		return FALSE;
+
+	box.x1 = box.y1 = 0;
+	box.x2 = pScreen->width;
+	box.y2 = pScreen->height;
+	return RegionContainsRect(&pWin->borderClip, &box) == rgnIN;
+}
+
+/* The shadow and framebuffer must be in sync. */
+static void
+scfbBypassStart(ScreenPtr pScreen)
+{
+	ScrnInfoPtr pScrn = xf86ScreenToScrn(pScreen);
+	ScfbPtr fPtr = SCFBPTR(pScrn);
+
+	pScreen->ModifyPixmapHeader(pScreen->GetScreenPixmap(pScreen),
+	    -1, -1, -1, -1, -1, fPtr->fbmem);
+	fPtr->bypass = TRUE;
+	xf86DrvMsg(pScrn->scrnIndex, X_INFO,
+	    "Full screen window, drawing to the framebuffer directly\n");
+}
+
+/* Bring the shadow up to date and draw to it again. */
+void
+ScfbBypassStop(ScrnInfoPtr pScrn)
+{
+	ScfbPtr fPtr = SCFBPTR(pScrn);
+	ScreenPtr pScreen = pScrn->pScreen;
+	PixmapPtr pPixmap;
+	CARD64 start;
+
+	if (!fPtr->bypass)
+		return;
+
+	start = GetTimeInMicros();
+	memcpy(fPtr->shadow, fPtr->fbmem,
+	    (size_t)fPtr->linebytes * fPtr->imgHeight);
+	pPixmap = pScreen->GetScreenPixmap(pScreen);
+	if (pPixmap->devPrivate.ptr == fPtr->fbmem)
+		pScreen->ModifyPixmapHeader(pPixmap, -1, -1, -1, -1, -1,
+		    fPtr->shadow);
+	else	/* Access is disabled around a VT switch. */
+		pScrn->pixmapPrivate.ptr = fPtr->shadow;
+	fPtr->bypass = FALSE;
+	xf86DrvMsg(pScrn->scrnIndex, X_INFO,
+	    "Back to the shadow framebuffer in %llu us\n",
+	    (unsigned long long)(GetTimeInMicros() - start));
+}
+
+void
+ScfbShadowUpdate(ScreenPtr pScreen, shadowBufPtr pBuf)
+{
+	ScrnInfoPtr pScrn = xf86ScreenToScrn(pScreen);
+	ScfbPtr fPtr = SCFBPTR(pScrn);
+	RegionPtr damage = DamageRegion(pBuf->pDamage);
+
+	fPtr->statWakeups++;
+	if (fPtr->tuning)
+		ScfbTuneApply(pScrn);
+
+	/* Repainted in full once the DGA client is done. */
+	if (fPtr->dgaActive) {
+		fPtr->damageStart = fPtr->inputStart = 0;
+		return;
+	}
+
+	/* Everything was drawn to the framebuffer already. */
+	if (fPtr->bypass) {
+		fPtr->damageStart = fPtr->inputStart = 0;
+		if (!scfbBypassWanted(pScreen))
+			ScfbBypassStop(pScrn);
+		return;
+	}
+
+	if (fPtr->panning)
+		ScfbPanApply(pScrn);
+	if (fPtr->backoffMax > 0)
+		scfbFlushSchedule(pScrn, damage);
+	else
+		scfbFlushSubmit(pScrn, damage);
+	scfbWakeupsPublish(pScrn);
+	if (fPtr->flushBudget > 0)
+		scfbSchedPublish(pScrn);
+	if (fPtr->latencyStats)
+		scfbLatencyPublish(pScrn);
+	ScfbPoolPublish(pScrn);
+	ScfbClientPublish(pScrn);
+
+	if (scfbBypassWanted(pScreen)) {
+		ScfbFlushSync(pScrn);
+		scfbBypassStart(pScreen);
+	}
+}
+
+/*
+ * Without a shadow framebuffer the screen pixmap still lives in system
+ * memory, so that GetImage and friends never read the framebuffer.
+ * Every rendering operation is written through to the framebuffer as
+ * soon as it completes, which keeps the unshadowed update semantics.
+ */
+static void
+scfbMirrorReport(DamagePtr pDamage, RegionPtr pRegion, void *closure)
+{
+	ScrnInfoPtr pScrn = closure;
+
+	if (SCFBPTR(pScrn)->tuning)
+		ScfbTuneApply(pScrn);
+	ScfbPoolPublish(pScrn);
+	ScfbClientPublish(pScrn);
+	if (pScrn->vtSema && !SCFBPTR(pScrn)->dgaActive) {
+		if (SCFBPTR(pScrn)->panning)
+			ScfbPanApply(pScrn);
+		ScfbFlushRegion(pScrn, pRegion);
+	}
+}
+
+Bool
+ScfbMirrorStart(ScreenPtr pScreen)
+{
+	ScrnInfoPtr pScrn = xf86ScreenToScrn(pScreen);
+	ScfbPtr fPtr = SCFBPTR(pScrn);
+	PixmapPtr pPixmap = pScreen->GetScreenPixmap(pScreen);
+
+	fPtr->mirrorDamage = DamageCreate(scfbMirrorReport, NULL,
+	    DamageReportRawRegion, TRUE, pScreen, pScrn);
+	if (fPtr->mirrorDamage == NULL)
+		return FALSE;
+	DamageSetReportAfterOp(fPtr->mirrorDamage, TRUE);
+	DamageRegister(&pPixmap->drawable, fPtr->mirrorDamage);
+	return TRUE;
+}
+
+/* Copy all of the shadow or mirror to the framebuffer again. */
+void
+ScfbRepaint(ScrnInfoPtr pScrn)
+{
+	ScreenPtr pScreen = pScrn->pScreen;
+	PixmapPtr pPixmap = pScreen->GetScreenPixmap(pScreen);
+	RegionRec full;
+	BoxRec box;
+
+	box.x1 = box.y1 = 0;
+	box.x2 = pPixmap->drawable.width;
+	box.y2 = pPixmap->drawable.height;
+	RegionInit(&full, &box, 1);
+	DamageDamageRegion(&pPixmap->drawable, &full);
+	RegionUninit(&full);
+}
+
+/*
+ * Panning.  The viewport of a screen larger than the framebuffer follows
+ * the pointer.  AdjustFrame may run on the input thread, so it only notes
+ * where the viewport should go, and it is moved here, before the next
+ * flush.  When the framebuffer can cheaply be read, what stays in view
+ * is moved inside it and only the strips coming into view are copied
+ * from the shadow; otherwise the whole viewport is copied again.
+ */
+static void
+scfbPanShift(ScrnInfoPtr pScrn, int dx, int dy)
+{
+	ScfbPtr fPtr = SCFBPTR(pScrn);
+	int cpp = fPtr->expand ? 4 : pScrn->bitsPerPixel / 8;
+	int lb = fPtr->linebytes;
+	int w = fPtr->imgWidth - (dx < 0 ? -dx : dx);
+	int h = fPtr->imgHeight - (dy < 0 ? -dy : dy);
+	CARD8 *src, *dst;
+	int i, step;
+
+	src = fPtr->fbmem + max(dy, 0) * lb + max(dx, 0) * cpp;
+	dst = fPtr->fbmem + max(-dy, 0) * lb + max(-dx, 0) * cpp;
+	step = lb;
+	if (dy < 0) {
+		src += (h - 1) * lb;
+		dst += (h - 1) * lb;
+		step = -lb;
+	}
+	for (i = 0; i < h; i++, src += step, dst += step)
+		memmove(dst, src, w * cpp);
+}
+
+void
+ScfbPanApply(ScrnInfoPtr pScrn)
+{
+	ScfbPtr fPtr = SCFBPTR(pScrn);
+	int x = fPtr->panX, y = fPtr->panY;
+	int dx = x - fPtr->viewX, dy = y - fPtr->viewY;
+	RegionRec exposed, kept;
+	BoxRec box;
+
+	if (dx == 0 && dy == 0)
+		return;
+
+	/* The worker maps boxes through the viewport. */
+	ScfbFlushSync(pScrn);
+	fPtr->viewX = x;
+	fPtr->viewY = y;
+	fPtr->xform.x0 += dx;
+	fPtr->xform.y0 += dy;
+	ScfbRecordLayout(pScrn);
+
+	box.x1 = x;
+	box.y1 = y;
+	box.x2 = x + fPtr->viewWidth;
+	box.y2 = y + fPtr->viewHeight;
+	RegionInit(&exposed, &box, 1);
+	if (fPtr->scrollInPlace && fPtr->scale == SCFB_SCALE_ONE &&
+	    fPtr->packDepth == 0 && !fPtr->dirtyNotify &&
+	    dx > -fPtr->viewWidth && dx < fPtr->viewWidth &&
+	    dy > -fPtr->viewHeight && dy < fPtr->viewHeight) {
+		scfbPanShift(pScrn, dx, dy);
+		box.x1 -= dx;
+		box.y1 -= dy;
+		box.x2 -= dx;
+		box.y2 -= dy;
+		RegionInit(&kept, &box, 1);
+		RegionSubtract(&exposed, &exposed, &kept);
+		RegionUninit(&kept);
+	}
+	ScfbFlushRegion(pScrn, &exposed);
+	RegionUninit(&exposed);
+}
+
+/*
+ * Software gamma.  The colormap layer hands over the gamma corrected
+ * ramp of each channel as a palette, which is folded into one table per
+ * byte of a shadow pixel.  Each entry is the corrected channel already
+ * in its place in a framebuffer pixel, so the lookup also does the
+ * swizzle.  An identity ramp costs nothing.
+ */
+static void
+scfbGammaTables(ScrnInfoPtr pScrn)
+{
+	ScfbPtr fPtr = SCFBPTR(pScrn);
+	const int src[3] = { pScrn->offset.red, pScrn->offset.green,
+	    pScrn->offset.blue };
+	const rgb *fb = fPtr->swizzle ? &fPtr->fbOffset : &pScrn->offset;
+	const int dst[3] = { fb->red, fb->green, fb->blue };
+	Bool identity = TRUE;
+	int c, i;
+
+	for (c = 0; c < 3; c++)
+		for (i = 0; i < 256; i++) {
+			fPtr->gammaLut[src[c] / 8 * 256 + i] =
+			    (CARD32)fPtr->gammaRamp[c][i] << dst[c];
+			if (fPtr->gammaRamp[c][i] != i)
+				identity = FALSE;
+		}
+	fPtr->gamma = !identity;
+}
+
+void
+ScfbGammaInit(ScrnInfoPtr pScrn)
+{
+	ScfbPtr fPtr = SCFBPTR(pScrn);
+	int c, i;
+
+	for (c = 0; c < 3; c++)
+		for (i = 0; i < 256; i++)
+			fPtr->gammaRamp[c][i] = i;
+	scfbGammaTables(pScrn);
+}
+
+void
+ScfbGammaLoad(ScrnInfoPtr pScrn, int numColors, int *indices, LOCO *colors)
+{
+	ScfbPtr fPtr = SCFBPTR(pScrn);
+	Bool was = fPtr->gamma;
+	Bool started = fPtr->shadowDamage != NULL ||
+	    fPtr->mirrorDamage != NULL;
+	int i, n;
+
+	/* The worker must not see half updated tables. */
+	if (started)
+		ScfbFlushSync(pScrn);
+	for (i = 0; i < numColors; i++) {
+		n = indices[i];
+		if (n < 0 || n > 255)
+			continue;
+		fPtr->gammaRamp[0][n] = colors[n].red;
+		fPtr->gammaRamp[1][n] = colors[n].green;
+		fPtr->gammaRamp[2][n] = colors[n].blue;
+	}
+	scfbGammaTables(pScrn);
+	if (!was && !fPtr->gamma)
+		return;
+
+	/* One full flush instead of making clients redraw. */
+	if (started) {
+		ScfbBypassStop(pScrn);
+		ScfbRepaint(pScrn);
+	}
+}
+
+/* Timestamp the first damage after each flush. */
+static void
+scfbLatencyDamage(DamagePtr pDamage, RegionPtr pRegion, void *closure)
+{
+	ScfbPtr fPtr = closure;
+
+	if (fPtr->damageStart == 0)
+		fPtr->damageStart = scfbNanos();
+}
+
+Bool
+ScfbLatencyStart(ScreenPtr pScreen)
+{
+	ScrnInfoPtr pScrn = xf86ScreenToScrn(pScreen);
+	ScfbPtr fPtr = SCFBPTR(pScrn);
+	PixmapPtr pPixmap = pScreen->GetScreenPixmap(pScreen);
+
+	fPtr->latencyDamage = DamageCreate(scfbLatencyDamage, NULL,
+	    DamageReportRawRegion, TRUE, pScreen, fPtr);
+	if (fPtr->latencyDamage == NULL)
+		return FALSE;
+	DamageRegister(&pPixmap->drawable, fPtr->latencyDamage);
+	return TRUE;
+}
+
+/*
+ * The damage layer would destroy this with the screen pixmap, but only
+ * later in the close; take it off before the shadow it watches is torn
+ * down, so nothing is reported to it meanwhile.
+ */
+void
+ScfbLatencyStop(ScreenPtr pScreen)
+{
+	ScrnInfoPtr pScrn = xf86ScreenToScrn(pScreen);
+	ScfbPtr fPtr = SCFBPTR(pScrn);
+
+	if (fPtr->latencyDamage == NULL)
+		return;
+#if GET_ABI_MAJOR(ABI_VIDEODRV_VERSION) < 15
+	DamageUnregister(&pScreen->GetScreenPixmap(pScreen)->drawable,
+	    fPtr->latencyDamage);
+#else
+	DamageUnregister(fPtr->latencyDamage);
+#endif
+	DamageDestroy(fPtr->latencyDamage);
+	fPtr->latencyDamage = NULL;
+}
+
+void
+ScfbLatencyInput(ScrnInfoPtr pScrn)
+{
+	ScfbPtr fPtr = SCFBPTR(pScrn);
+
+	if (fPtr->latencyStats && fPtr->inputStart == 0)
+		fPtr->inputStart = scfbNanos();
+}
+
+static void
+scfbLatencyLog(ScrnInfoPtr pScrn, const char *what, const ScfbLatencyRec *lat)
+{
+	if (lat->count == 0)
+		return;
+	xf86DrvMsg(pScrn->scrnIndex, X_INFO, "%s to flush latency: %u "
+	    "samples, p50 %u us, p99 %u us, max %u us\n", what,
+	    (unsigned)lat->count, (unsigned)scfbLatencyPercentile(lat, 50),
+	    (unsigned)scfbLatencyPercentile(lat, 99), (unsigned)lat->max);
+}
+
+/* Called with the worker stopped. */
+void
+ScfbLatencyReport(ScrnInfoPtr pScrn)
+{
+	ScfbPtr fPtr = SCFBPTR(pScrn);
+
+	scfbLatencyLog(pScrn, "Damage", &fPtr->latDamage);
+	scfbLatencyLog(pScrn, "Pointer", &fPtr->latInput);
+}
@@ -0,0 +1,582 @@
+/*
+ * Copyright © 2001-2012 Matthieu Herrb
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *    - Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    - Redistributions in binary form must reproduce the above
+ *      copyright notice, this list of conditions and the following
+ *      disclaimer in the documentation and/or other materials provided
+ *      with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ * ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <string.h>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "scfb_kernels.h"
+
+void
+scfb_fetch_step(uint8_t *dst, const uint8_t *src, ptrdiff_t step, int n,
+		int cpp)
+{
+	int i;
+
+	switch (cpp) {
+	case 1:
+		for (i = 0; i < n; i++, src += step)
+			dst[i] = *src;
+		break;
+	case 2: {
+		uint16_t *d = (uint16_t *)dst;
+
+		for (i = 0; i < n; i++, src += step)
+			d[i] = *(const uint16_t *)src;
+		break;
+	}
+	case 4: {
+		uint32_t *d = (uint32_t *)dst;
+
+		for (i = 0; i < n; i++, src += step)
+			d[i] = *(const uint32_t *)src;
+		break;
+	}
+	default:
+		for (i = 0; i < n; i++, src += step, dst += cpp)
+			memcpy(dst, src, cpp);
+		break;
+	}
+}
+
+void
+scfb_scale_int(uint8_t *dst, const uint8_t *src, int n, int k, int cpp)
+{
+	int i, j;
+
+	if (cpp == 4) {
+		const uint32_t *s = (const uint32_t *)src;
+		uint32_t *d = (uint32_t *)dst;
+
+		i = 0;
+		if (k == 2) {
+#ifdef __SSE2__
+			for (; i + 4 <= n; i += 4, d += 8) {
+				__m128i p = _mm_loadu_si128((const __m128i *)(s + i));
+
+				_mm_storeu_si128((__m128i *)d,
+				    _mm_unpacklo_epi32(p, p));
+				_mm_storeu_si128((__m128i *)(d + 4),
+				    _mm_unpackhi_epi32(p, p));
+			}
+#endif
+			for (; i < n; i++, d += 2)
+				d[0] = d[1] = s[i];
+			return;
+		}
+		for (; i < n; i++)
+			for (j = 0; j < k; j++)
+				*d++ = s[i];
+		return;
+	}
+	if (cpp == 2) {
+		const uint16_t *s = (const uint16_t *)src;
+		uint16_t *d = (uint16_t *)dst;
+
+		i = 0;
+		if (k == 2) {
+#ifdef __SSE2__
+			for (; i + 8 <= n; i += 8, d += 16) {
+				__m128i p = _mm_loadu_si128((const __m128i *)(s + i));
+
+				_mm_storeu_si128((__m128i *)d,
+				    _mm_unpacklo_epi16(p, p));
+				_mm_storeu_si128((__m128i *)(d + 8),
+				    _mm_unpackhi_epi16(p, p));
+			}
+#endif
+			for (; i < n; i++, d += 2)
+				d[0] = d[1] = s[i];
+			return;
+		}
+		for (; i < n; i++)
+			for (j = 0; j < k; j++)
+				*d++ = s[i];
+		return;
+	}
+	for (i = 0; i < n; i++, src += cpp)
+		for (j = 0; j < k; j++, dst += cpp)
+			memcpy(dst, src, cpp);
+}
+
+void
+scfb_scale_nearest(uint8_t *dst, const uint8_t *src, int n, uint32_t fx,
+		   uint32_t dfx, int cpp)
+{
+	int i;
+
+	switch (cpp) {
+	case 4: {
+		const uint32_t *s = (const uint32_t *)src;
+		uint32_t *d = (uint32_t *)dst;
+
+		for (i = 0; i < n; i++, fx += dfx)
+			d[i] = s[fx >> 16];
+		break;
+	}
+	case 2: {
+		const uint16_t *s = (const uint16_t *)src;
+		uint16_t *d = (uint16_t *)dst;
+
+		for (i = 0; i < n; i++, fx += dfx)
+			d[i] = s[fx >> 16];
+		break;
+	}
+	default:
+		for (i = 0; i < n; i++, fx += dfx, dst += cpp)
+			memcpy(dst, src + (fx >> 16) * cpp, cpp);
+		break;
+	}
+}
+
+/* Blend two 32bpp pixels, w is the weight of b in 0-255. */
+static inline uint32_t
+scfb_lerp32(uint32_t a, uint32_t b, uint32_t w)
+{
+	uint32_t rb, ag;
+
+	rb = (((a & 0x00ff00ff) * (256 - w) + (b & 0x00ff00ff) * w) >> 8) &
+	    0x00ff00ff;
+	ag = (((a >> 8) & 0x00ff00ff) * (256 - w) +
+	    ((b >> 8) & 0x00ff00ff) * w) & 0xff00ff00;
+	return rb | ag;
+}
+
+void
+scfb_scale_bilinear32(uint32_t *dst, const uint32_t *r0, const uint32_t *r1,
+		      int n, uint32_t fx, uint32_t dfx, int wy)
+{
+	uint32_t top, bot, w;
+	int i, x;
+
+	for (i = 0; i < n; i++, fx += dfx) {
+		x = fx >> 16;
+		w = (fx >> 8) & 0xff;
+		top = scfb_lerp32(r0[x], r0[x + 1], w);
+		bot = scfb_lerp32(r1[x], r1[x + 1], w);
+		dst[i] = scfb_lerp32(top, bot, wy);
+	}
+}
+
+/*
+ * With cpp dividing 4, the pixel replicated over 32 bits is the same
+ * pattern at every pixel aligned address, so rows can be filled with
+ * aligned wide stores once the head has been done pixel by pixel.
+ */
+static void
+scfb_fill_row(uint8_t *d, size_t n, uint32_t p32, int cpp)
+{
+	uint32_t *w;
+
+	while (n > 0 && ((uintptr_t)d & 3) != 0) {
+		memcpy(d, &p32, cpp);
+		d += cpp;
+		n -= cpp;
+	}
+	w = (uint32_t *)d;
+#ifdef __SSE2__
+	if (n >= 64) {
+		__m128i p = _mm_set1_epi32(p32);
+
+		while (((uintptr_t)w & 15) != 0) {
+			*w++ = p32;
+			n -= 4;
+		}
+		for (; n >= 64; n -= 64, w += 16) {
+			_mm_store_si128((__m128i *)w, p);
+			_mm_store_si128((__m128i *)(w + 4), p);
+			_mm_store_si128((__m128i *)(w + 8), p);
+			_mm_store_si128((__m128i *)(w + 12), p);
+		}
+	}
+#endif
+	for (; n >= 4; n -= 4)
+		*w++ = p32;
+	d = (uint8_t *)w;
+	for (; n > 0; n -= cpp, d += cpp)
+		memcpy(d, &p32, cpp);
+}
+
+void
+scfb_fill(uint8_t *dst, ptrdiff_t pitch, int w, int h, uint32_t pixel,
+    int cpp)
+{
+	uint32_t p32;
+
+	switch (cpp) {
+	case 1:
+		p32 = (pixel & 0xff) * 0x01010101U;
+		break;
+	case 2:
+		p32 = (pixel & 0xffff) * 0x00010001U;
+		break;
+	default:
+		p32 = pixel;
+		break;
+	}
+	for (; h > 0; h--, dst += pitch)
+		scfb_fill_row(dst, (size_t)w * cpp, p32, cpp);
+}
+
+void
+scfb_copy(uint8_t *dst, const uint8_t *src, size_t n)
+{
+	memcpy(dst, src, n);
+}
+
+void
+scfb_copy_stream(uint8_t *dst, const uint8_t *src, size_t n)
+{
+#ifdef __SSE2__
+	size_t head;
+
+	if (n >= 256) {
+		head = -(uintptr_t)dst & 15;
+		memcpy(dst, src, head);
+		dst += head;
+		src += head;
+		n -= head;
+		for (; n >= 64; n -= 64, dst += 64, src += 64) {
+			const __m128i *s = (const __m128i *)src;
+			__m128i a = _mm_loadu_si128(s);
+			__m128i b = _mm_loadu_si128(s + 1);
+			__m128i c = _mm_loadu_si128(s + 2);
+			__m128i d = _mm_loadu_si128(s + 3);
+
+			_mm_stream_si128((__m128i *)dst, a);
+			_mm_stream_si128((__m128i *)dst + 1, b);
+			_mm_stream_si128((__m128i *)dst + 2, c);
+			_mm_stream_si128((__m128i *)dst + 3, d);
+		}
+		_mm_sfence();
+	}
+#endif
+	memcpy(dst, src, n);
+}
+
+void
+scfb_copy_words(uint8_t *dst, const uint8_t *src, size_t n)
+{
+	uint32_t *d, a, b, c, e;
+
+	/* Rows need not start on a word. */
+	for (; n > 0 && ((uintptr_t)dst & 3) != 0; n--)
+		*dst++ = *src++;
+	d = (uint32_t *)dst;
+	for (; n >= 16; n -= 16, d += 4, src += 16) {
+		memcpy(&a, src, 4);
+		memcpy(&b, src + 4, 4);
+		memcpy(&c, src + 8, 4);
+		memcpy(&e, src + 12, 4);
+		d[0] = a;
+		d[1] = b;
+		d[2] = c;
+		d[3] = e;
+	}
+	for (; n >= 4; n -= 4, d++, src += 4)
+		memcpy(d, src, 4);
+	dst = (uint8_t *)d;
+	while (n-- > 0)
+		*dst++ = *src++;
+}
+
+void
+scfb_blit_trans(uint8_t *dst, const uint8_t *src, int n, uint32_t key,
+    int cpp)
+{
+	size_t len = (size_t)n * cpp, i = 0;
+
+#ifdef __SSE2__
+	__m128i k, s, d, m;
+
+	switch (cpp) {
+	case 1:
+		k = _mm_set1_epi8((char)key);
+		break;
+	case 2:
+		k = _mm_set1_epi16((short)key);
+		break;
+	default:
+		k = _mm_set1_epi32((int)key);
+		break;
+	}
+	for (; i + 16 <= len; i += 16) {
+		s = _mm_loadu_si128((const __m128i *)(src + i));
+		d = _mm_loadu_si128((const __m128i *)(dst + i));
+		switch (cpp) {
+		case 1:
+			m = _mm_cmpeq_epi8(s, k);
+			break;
+		case 2:
+			m = _mm_cmpeq_epi16(s, k);
+			break;
+		default:
+			m = _mm_cmpeq_epi32(s, k);
+			break;
+		}
+		_mm_storeu_si128((__m128i *)(dst + i),
+		    _mm_or_si128(_mm_and_si128(m, d), _mm_andnot_si128(m, s)));
+	}
+#endif
+	switch (cpp) {
+	case 1:
+		for (; i < len; i++)
+			if (src[i] != (uint8_t)key)
+				dst[i] = src[i];
+		break;
+	case 2:
+		for (; i < len; i += 2)
+			if (*(const uint16_t *)(src + i) != (uint16_t)key)
+				*(uint16_t *)(dst + i) =
+				    *(const uint16_t *)(src + i);
+		break;
+	default:
+		for (; i < len; i += 4)
+			if (*(const uint32_t *)(src + i) != key)
+				*(uint32_t *)(dst + i) =
+				    *(const uint32_t *)(src + i);
+		break;
+	}
+}
+
+void
+scfb_swizzle32(uint32_t *dst, const uint32_t *src, int n, int roff,
+    int goff, int boff)
+{
+	int i = 0;
+	uint32_t p;
+
+#ifdef __SSE2__
+	__m128i mask = _mm_set1_epi32(0xff), s, r, g, b;
+	__m128i rs = _mm_cvtsi32_si128(roff);
+	__m128i gs = _mm_cvtsi32_si128(goff);
+	__m128i bs = _mm_cvtsi32_si128(boff);
+
+	for (; i + 4 <= n; i += 4) {
+		s = _mm_loadu_si128((const __m128i *)(src + i));
+		r = _mm_and_si128(_mm_srli_epi32(s, 16), mask);
+		g = _mm_and_si128(_mm_srli_epi32(s, 8), mask);
+		b = _mm_and_si128(s, mask);
+		_mm_storeu_si128((__m128i *)(dst + i),
+		    _mm_or_si128(_mm_or_si128(_mm_sll_epi32(r, rs),
+		    _mm_sll_epi32(g, gs)), _mm_sll_epi32(b, bs)));
+	}
+#endif
+	for (; i < n; i++) {
+		p = src[i];
+		dst[i] = ((p >> 16) & 0xff) << roff |
+		    ((p >> 8) & 0xff) << goff | (p & 0xff) << boff;
+	}
+}
+
+#ifdef __SSE2__
+static inline __m128i
+scfb_expand565_4(__m128i p, __m128i rs, __m128i gs, __m128i bs)
+{
+	__m128i r, g, b;
+
+	r = _mm_srli_epi32(p, 11);
+	r = _mm_or_si128(_mm_slli_epi32(r, 3), _mm_srli_epi32(r, 2));
+	g = _mm_and_si128(_mm_srli_epi32(p, 5), _mm_set1_epi32(0x3f));
+	g = _mm_or_si128(_mm_slli_epi32(g, 2), _mm_srli_epi32(g, 4));
+	b = _mm_and_si128(p, _mm_set1_epi32(0x1f));
+	b = _mm_or_si128(_mm_slli_epi32(b, 3), _mm_srli_epi32(b, 2));
+	return _mm_or_si128(_mm_or_si128(_mm_sll_epi32(r, rs),
+	    _mm_sll_epi32(g, gs)), _mm_sll_epi32(b, bs));
+}
+#endif
+
+void
+scfb_expand565(uint32_t *dst, const uint16_t *src, int n, int roff,
+    int goff, int boff)
+{
+	int i = 0;
+	uint32_t p, r, g, b;
+
+#ifdef __SSE2__
+	__m128i zero = _mm_setzero_si128(), s;
+	__m128i rs = _mm_cvtsi32_si128(roff);
+	__m128i gs = _mm_cvtsi32_si128(goff);
+	__m128i bs = _mm_cvtsi32_si128(boff);
+
+	for (; i + 8 <= n; i += 8) {
+		s = _mm_loadu_si128((const __m128i *)(src + i));
+		_mm_storeu_si128((__m128i *)(dst + i),
+		    scfb_expand565_4(_mm_unpacklo_epi16(s, zero), rs, gs, bs));
+		_mm_storeu_si128((__m128i *)(dst + i + 4),
+		    scfb_expand565_4(_mm_unpackhi_epi16(s, zero), rs, gs, bs));
+	}
+#endif
+	for (; i < n; i++) {
+		p = src[i];
+		r = p >> 11;
+		g = (p >> 5) & 0x3f;
+		b = p & 0x1f;
+		dst[i] = (r << 3 | r >> 2) << roff | (g << 2 | g >> 4) << goff |
+		    (b << 3 | b >> 2) << boff;
+	}
+}
+
+void
+scfb_lut32(uint32_t *dst, const uint32_t *src, int n, const uint32_t *lut)
+{
+	int i = 0;
+	uint32_t p, q;
+
+#ifdef __AVX2__
+	__m256i mask = _mm256_set1_epi32(0xff), s, r;
+
+	for (; i + 8 <= n; i += 8) {
+		s = _mm256_loadu_si256((const __m256i *)(src + i));
+		r = _mm256_i32gather_epi32((const int *)lut,
+		    _mm256_and_si256(s, mask), 4);
+		r = _mm256_or_si256(r, _mm256_i32gather_epi32(
+		    (const int *)lut + 256,
+		    _mm256_and_si256(_mm256_srli_epi32(s, 8), mask), 4));
+		r = _mm256_or_si256(r, _mm256_i32gather_epi32(
+		    (const int *)lut + 512,
+		    _mm256_and_si256(_mm256_srli_epi32(s, 16), mask), 4));
+		_mm256_storeu_si256((__m256i *)(dst + i), r);
+	}
+#endif
+	/* Two at a time, so that the loads of both overlap. */
+	for (; i + 2 <= n; i += 2) {
+		p = src[i];
+		q = src[i + 1];
+		dst[i] = lut[p & 0xff] | lut[256 + (p >> 8 & 0xff)] |
+		    lut[512 + (p >> 16 & 0xff)];
+		dst[i + 1] = lut[q & 0xff] | lut[256 + (q >> 8 & 0xff)] |
+		    lut[512 + (q >> 16 & 0xff)];
+	}
+	if (i < n) {
+		p = src[i];
+		dst[i] = lut[p & 0xff] | lut[256 + (p >> 8 & 0xff)] |
+		    lut[512 + (p >> 16 & 0xff)];
+	}
+}
+
+void
+scfb_pack4(uint8_t *dst, const uint8_t *src, int n)
+{
+	int i = 0;
+
+#ifdef __SSE2__
+	__m128i lo = _mm_set1_epi16(0x0f), a, b;
+
+	/* Each 16 bit lane holds two pixels, the left one in the low byte. */
+	for (; i + 32 <= n; i += 32, dst += 16) {
+		a = _mm_loadu_si128((const __m128i *)(src + i));
+		b = _mm_loadu_si128((const __m128i *)(src + i + 16));
+		a = _mm_or_si128(_mm_slli_epi16(_mm_and_si128(a, lo), 4),
+		    _mm_and_si128(_mm_srli_epi16(a, 8), lo));
+		b = _mm_or_si128(_mm_slli_epi16(_mm_and_si128(b, lo), 4),
+		    _mm_and_si128(_mm_srli_epi16(b, 8), lo));
+		_mm_storeu_si128((__m128i *)dst, _mm_packus_epi16(a, b));
+	}
+#endif
+	for (; i + 2 <= n; i += 2)
+		*dst++ = (src[i] & 0x0f) << 4 | (src[i + 1] & 0x0f);
+	if (i < n)
+		*dst = (src[i] & 0x0f) << 4;
+}
+
+void
+scfb_pack1(uint8_t *dst, const uint8_t *src, int n, const uint8_t *lut)
+{
+	int i = 0, j;
+	uint8_t b;
+
+	for (; i + 8 <= n; i += 8, src += 8)
+		*dst++ = lut[src[0]] << 7 | lut[src[1]] << 6 |
+		    lut[src[2]] << 5 | lut[src[3]] << 4 |
+		    lut[src[4]] << 3 | lut[src[5]] << 2 |
+		    lut[src[6]] << 1 | lut[src[7]];
+	if (i < n) {
+		b = 0;
+		for (j = 0; i + j < n; j++)
+			b |= lut[src[j]] << (7 - j);
+		*dst = b;
+	}
+}
+
+int
+scfb_lut_threshold(const uint8_t *lut, int *invert)
+{
+	int i, t;
+
+	for (t = 1; t < 256 && lut[t] == lut[0]; t++)
+		;
+	if (t == 256)
+		return -1;
+	for (i = t + 1; i < 256; i++)
+		if (lut[i] != lut[t])
+			return -1;
+	*invert = lut[0];
+	return t;
+}
+
+void
+scfb_pack1_threshold(uint8_t *dst, const uint8_t *src, int n, int thresh,
+    int invert)
+{
+	int i = 0, j;
+	uint8_t b, x = invert ? 0xff : 0;
+
+#ifdef __SSE2__
+	__m128i t = _mm_set1_epi8((char)thresh), v;
+	unsigned int m;
+
+	for (; i + 16 <= n; i += 16, dst += 2) {
+		v = _mm_loadu_si128((const __m128i *)(src + i));
+		m = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_max_epu8(v, t), v));
+		m ^= x << 8 | x;
+		/* The leftmost pixel goes in the top bit of each byte. */
+		m = (m & 0xf0f0) >> 4 | (m & 0x0f0f) << 4;
+		m = (m & 0xcccc) >> 2 | (m & 0x3333) << 2;
+		m = (m & 0xaaaa) >> 1 | (m & 0x5555) << 1;
+		dst[0] = m;
+		dst[1] = m >> 8;
+	}
+#endif
+	for (; i < n; i += 8) {
+		b = 0;
+		for (j = 0; j < 8 && i + j < n; j++)
+			b |= (src[i + j] >= thresh) << (7 - j);
+		/* Padding stays zero. */
+		*dst++ = b ^ (x & (0xff << (8 - j)));
+	}
+}
@@ -0,0 +1,140 @@
+/*
+ * Copyright © 2001-2012 Matthieu Herrb
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *    - Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    - Redistributions in binary form must reproduce the above
+ *      copyright notice, this list of conditions and the following
+ *      disclaimer in the documentation and/or other materials provided
+ *      with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ * ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/*
+ * Pixel kernels used by the shadow flush.  These only deal with plain
+ * memory and have no dependency on the X server.
+ */
+
+#ifndef SCFB_KERNELS_H
+#define SCFB_KERNELS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Gather n pixels of cpp bytes each, located step bytes apart in src,
+ * into consecutive pixels at dst.
+ */
+extern void scfb_fetch_step(uint8_t *dst, const uint8_t *src,
+			    ptrdiff_t step, int n, int cpp);
+
+/*
+ * Replicate each of the n pixels in src k times horizontally, writing
+ * n * k pixels to dst.  Used for integer output scaling.
+ */
+extern void scfb_scale_int(uint8_t *dst, const uint8_t *src, int n, int k,
+			   int cpp);
+
+/*
+ * Nearest neighbour and bilinear horizontal resampling.  fx is the 16.16
+ * source position of the first destination pixel, dfx the 16.16 source
+ * step per destination pixel.  The bilinear variant blends rows r0 and r1
+ * with weight wy (0-255, towards r1) and reads up to one pixel past the
+ * last sampled position.
+ */
+extern void scfb_scale_nearest(uint8_t *dst, const uint8_t *src, int n,
+			       uint32_t fx, uint32_t dfx, int cpp);
+extern void scfb_scale_bilinear32(uint32_t *dst, const uint32_t *r0,
+				  const uint32_t *r1, int n, uint32_t fx,
+				  uint32_t dfx, int wy);
+
+/*
+ * Fill a w x h rectangle of cpp (1, 2 or 4) byte pixels, whose rows are
+ * pitch bytes apart, with pixel.
+ */
+extern void scfb_fill(uint8_t *dst, ptrdiff_t pitch, int w, int h,
+		      uint32_t pixel, int cpp);
+
+/*
+ * Ways of copying n bytes to the framebuffer, which the flush chooses
+ * between by timing them on the mapping.  scfb_copy is memcpy,
+ * scfb_copy_stream bypasses the cache where the CPU allows and
+ * scfb_copy_words stores only aligned 32 bit words, for mappings that
+ * handle narrower or unaligned accesses poorly.
+ */
+typedef void (*scfb_copy_proc)(uint8_t *dst, const uint8_t *src, size_t n);
+extern void scfb_copy(uint8_t *dst, const uint8_t *src, size_t n);
+extern void scfb_copy_stream(uint8_t *dst, const uint8_t *src, size_t n);
+extern void scfb_copy_words(uint8_t *dst, const uint8_t *src, size_t n);
+
+/*
+ * Copy the n pixels of src that are not equal to key to dst.  The two
+ * rows must not overlap.
+ */
+extern void scfb_blit_trans(uint8_t *dst, const uint8_t *src, int n,
+			    uint32_t key, int cpp);
+
+/*
+ * Convert n x8r8g8b8 pixels to pixels with 8 bit channels at bit offsets
+ * roff, goff and boff.  dst may be src.
+ */
+extern void scfb_swizzle32(uint32_t *dst, const uint32_t *src, int n,
+			   int roff, int goff, int boff);
+
+/*
+ * Widen n r5g6b5 pixels to pixels with 8 bit channels at bit offsets
+ * roff, goff and boff, replicating the top bits of each channel into the
+ * new low bits.
+ */
+extern void scfb_expand565(uint32_t *dst, const uint16_t *src, int n,
+			   int roff, int goff, int boff);
+
+/*
+ * Map n 32 bit pixels through three tables of 256 entries, one for each
+ * of the low three bytes of a source pixel, ORing the results:
+ *	dst[i] = lut[b0] | lut[256 + b1] | lut[512 + b2]
+ * The top byte is dropped.  dst may be src.
+ */
+extern void scfb_lut32(uint32_t *dst, const uint32_t *src, int n,
+		       const uint32_t *lut);
+
+/*
+ * Pack n 8 bit pixels into 4 or 1 bit ones, the leftmost pixel in the
+ * most significant bits.  A trailing partial byte is padded with zeros.
+ * scfb_pack4 keeps the low nibble, scfb_pack1 maps each pixel through
+ * lut, whose entries are 0 or 1.
+ */
+extern void scfb_pack4(uint8_t *dst, const uint8_t *src, int n);
+extern void scfb_pack1(uint8_t *dst, const uint8_t *src, int n,
+		       const uint8_t *lut);
+
+/*
+ * Most palettes split into dark and light pixels at one index.  When lut
+ * maps the pixels from some index t up to one value and those below to
+ * the other, scfb_lut_threshold returns t and sets invert to the value
+ * below t, otherwise it returns -1.  scfb_pack1_threshold then packs
+ * like scfb_pack1 without the table, a vector of pixels at a time.
+ */
+extern int scfb_lut_threshold(const uint8_t *lut, int *invert);
+extern void scfb_pack1_threshold(uint8_t *dst, const uint8_t *src, int n,
+				 int thresh, int invert);
+
+#endif /* SCFB_KERNELS_H */
@@ -0,0 +1,358 @@
+/*
+ * Copyright © 2001-2012 Matthieu Herrb
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *    - Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    - Redistributions in binary form must reproduce the above
+ *      copyright notice, this list of conditions and the following
+ *      disclaimer in the documentation and/or other materials provided
+ *      with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ * ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+
+/*
+ * Pool for small pixmaps.  fb allocates each pixmap, header and pixels
+ * in one block, with malloc.  Small ones are carved from 64 kB slabs
+ * instead, in power of two size classes, with the pixels aligned to a
+ * cache line.  Slabs are returned to the system once empty, unless they
+ * are the last with room in their class.  Pixmaps too large for the
+ * biggest class, or that would take the pool over its cap, are left to
+ * fb.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "xf86.h"
+#include "fb.h"
+#include "property.h"
+#include <X11/Xatom.h>
+
+#include "scfb.h"
+
+#define SCFB_POOL_PROPERTY	"_SCFB_PIXMAP_POOL"
+#define SCFB_SLAB_SIZE		(64 * 1024)
+#define SCFB_POOL_MIN_SHIFT	8	/* Smallest chunks, 256 bytes. */
+#define SCFB_POOL_ALIGN		64	/* Pixels start on a cache line. */
+
+typedef struct _ScfbSlab {
+	struct _ScfbSlab *	next;
+	struct _ScfbSlab *	prev;
+	CARD8 *			base;
+	void *			free; /* Chained through the free chunks. */
+	int			class;
+	int			used; /* Chunks handed out. */
+} ScfbSlabRec, *ScfbSlabPtr;
+
+/* Where a pooled pixmap came from; slab is NULL for fb's own. */
+typedef struct {
+	ScfbSlabPtr		slab;
+	size_t			size;
+} ScfbPoolPrivRec, *ScfbPoolPrivPtr;
+
+static DevPrivateKeyRec scfbPoolKeyRec;
+#define scfbPoolKey (&scfbPoolKeyRec)
+
+#define scfbGetPoolPriv(pPixmap) ((ScfbPoolPrivPtr) \
+	dixGetPrivateAddr(&(pPixmap)->devPrivates, scfbPoolKey))
+
+static int
+scfbPoolChunks(int class)
+{
+	return SCFB_SLAB_SIZE >> (SCFB_POOL_MIN_SHIFT + class);
+}
+
+static void
+scfbSlabUnlink(ScfbPtr fPtr, ScfbSlabPtr slab)
+{
+	if (slab->prev != NULL)
+		slab->prev->next = slab->next;
+	else
+		fPtr->poolSlabs[slab->class] = slab->next;
+	if (slab->next != NULL)
+		slab->next->prev = slab->prev;
+	slab->next = slab->prev = NULL;
+}
+
+/* Slabs with free chunks are kept at the head of their list. */
+static void
+scfbSlabPush(ScfbPtr fPtr, ScfbSlabPtr slab)
+{
+	slab->prev = NULL;
+	slab->next = fPtr->poolSlabs[slab->class];
+	if (slab->next != NULL)
+		slab->next->prev = slab;
+	fPtr->poolSlabs[slab->class] = slab;
+}
+
+static void
+scfbSlabAppend(ScfbPtr fPtr, ScfbSlabPtr slab)
+{
+	ScfbSlabPtr last = fPtr->poolSlabs[slab->class];
+
+	if (last == NULL) {
+		scfbSlabPush(fPtr, slab);
+		return;
+	}
+	while (last->next != NULL)
+		last = last->next;
+	last->next = slab;
+	slab->prev = last;
+	slab->next = NULL;
+}
+
+static ScfbSlabPtr
+scfbSlabNew(ScfbPtr fPtr, int class)
+{
+	int size = 1 << (SCFB_POOL_MIN_SHIFT + class);
+	ScfbSlabPtr slab;
+	void *base;
+	int i;
+
+	if (fPtr->poolBytes + SCFB_SLAB_SIZE > fPtr->poolMax)
+		return NULL;
+	slab = calloc(1, sizeof(*slab));
+	if (slab == NULL)
+		return NULL;
+	if (posix_memalign(&base, SCFB_POOL_ALIGN, SCFB_SLAB_SIZE) != 0) {
+		free(slab);
+		return NULL;
+	}
+	slab->base = base;
+	slab->class = class;
+	for (i = scfbPoolChunks(class) - 1; i >= 0; i--) {
+		*(void **)(slab->base + i * size) = slab->free;
+		slab->free = slab->base + i * size;
+	}
+	fPtr->poolBytes += SCFB_SLAB_SIZE;
+	scfbSlabPush(fPtr, slab);
+	return slab;
+}
+
+/* Whether another slab of the class can take the next allocation. */
+static Bool
+scfbSlabRoom(ScfbPtr fPtr, ScfbSlabPtr slab)
+{
+	ScfbSlabPtr s;
+
+	for (s = fPtr->poolSlabs[slab->class]; s != NULL; s = s->next)
+		if (s != slab && s->free != NULL)
+			return TRUE;
+	return FALSE;
+}
+
+static void
+scfbSlabFree(ScfbPtr fPtr, ScfbSlabPtr slab)
+{
+	scfbSlabUnlink(fPtr, slab);
+	fPtr->poolBytes -= SCFB_SLAB_SIZE;
+	free(slab->base);
+	free(slab);
+}
+
+static PixmapPtr scfbPoolCreatePixmap(ScreenPtr, int, int, int, unsigned);
+
+static PixmapPtr
+scfbPoolFallback(ScreenPtr pScreen, int width, int height, int depth,
+    unsigned usage)
+{
+	ScfbPtr fPtr = SCFBPTR(xf86ScreenToScrn(pScreen));
+	PixmapPtr pPixmap;
+
+	pScreen->CreatePixmap = fPtr->CreatePixmap;
+	pPixmap = pScreen->CreatePixmap(pScreen, width, height, depth, usage);
+	pScreen->CreatePixmap = scfbPoolCreatePixmap;
+	return pPixmap;
+}
+
+/* As fbCreatePixmap, from a slab. */
+static PixmapPtr
+scfbPoolCreatePixmap(ScreenPtr pScreen, int width, int height, int depth,
+    unsigned usage)
+{
+	ScfbPtr fPtr = SCFBPTR(xf86ScreenToScrn(pScreen));
+	size_t header, devKind, size;
+	PixmapPtr pPixmap;
+	ScfbSlabPtr slab;
+	int bpp, class;
+	void *chunk;
+
+	if (width <= 0 || height <= 0 || width > 4096 || height > 4096)
+		return scfbPoolFallback(pScreen, width, height, depth, usage);
+
+	bpp = BitsPerPixel(depth);
+	devKind = ((width * bpp + FB_MASK) >> FB_SHIFT) * sizeof(FbBits);
+	header = (pScreen->totalPixmapSize + SCFB_POOL_ALIGN - 1) &
+	    ~(SCFB_POOL_ALIGN - 1);
+	size = header + devKind * height;
+	for (class = 0; class < SCFB_POOL_CLASSES; class++)
+		if (size <= 1U << (SCFB_POOL_MIN_SHIFT + class))
+			break;
+	if (class == SCFB_POOL_CLASSES) {
+		fPtr->statPoolLarge++;
+		return scfbPoolFallback(pScreen, width, height, depth, usage);
+	}
+
+	slab = fPtr->poolSlabs[class];
+	if (slab == NULL || slab->free == NULL)
+		slab = scfbSlabNew(fPtr, class);
+	if (slab == NULL) {
+		fPtr->statPoolCapped++;
+		return scfbPoolFallback(pScreen, width, height, depth, usage);
+	}
+	chunk = slab->free;
+	slab->free = *(void **)chunk;
+	if (++slab->used == scfbPoolChunks(class) && slab->next != NULL) {
+		/* Full, out of the way of allocations. */
+		scfbSlabUnlink(fPtr, slab);
+		scfbSlabAppend(fPtr, slab);
+	}
+
+	/* What AllocatePixmap and fbCreatePixmap do. */
+	memset(chunk, 0, size);
+	pPixmap = chunk;
+	dixInitScreenPrivates(pScreen, pPixmap, pPixmap + 1, PRIVATE_PIXMAP);
+	pPixmap->drawable.type = DRAWABLE_PIXMAP;
+	pPixmap->drawable.pScreen = pScreen;
+	pPixmap->drawable.depth = depth;
+	pPixmap->drawable.bitsPerPixel = bpp;
+	pPixmap->drawable.serialNumber = NEXT_SERIAL_NUMBER;
+	pPixmap->drawable.width = width;
+	pPixmap->drawable.height = height;
+	pPixmap->devKind = devKind;
+	pPixmap->refcnt = 1;
+	pPixmap->devPrivate.ptr = (CARD8 *)chunk + header;
+	pPixmap->usage_hint = usage;
+	scfbGetPoolPriv(pPixmap)->slab = slab;
+	scfbGetPoolPriv(pPixmap)->size = size;
+
+	fPtr->statPoolAllocs++;
+	fPtr->poolChunkBytes += 1U << (SCFB_POOL_MIN_SHIFT + class);
+	fPtr->poolUsedBytes += size;
+	return pPixmap;
+}
+
+static Bool
+scfbPoolDestroyPixmap(PixmapPtr pPixmap)
+{
+	ScreenPtr pScreen = pPixmap->drawable.pScreen;
+	ScfbPtr fPtr = SCFBPTR(xf86ScreenToScrn(pScreen));
+	ScfbPoolPrivPtr priv = scfbGetPoolPriv(pPixmap);
+	ScfbSlabPtr slab = priv->slab;
+	Bool ret;
+
+	if (slab == NULL) {
+		pScreen->DestroyPixmap = fPtr->DestroyPixmap;
+		ret = pScreen->DestroyPixmap(pPixmap);
+		pScreen->DestroyPixmap = scfbPoolDestroyPixmap;
+		return ret;
+	}
+	if (--pPixmap->refcnt > 0)
+		return TRUE;
+
+	fPtr->poolChunkBytes -= 1U << (SCFB_POOL_MIN_SHIFT + slab->class);
+	fPtr->poolUsedBytes -= priv->size;
+	dixFiniPrivates(pPixmap, PRIVATE_PIXMAP);
+
+	*(void **)pPixmap = slab->free;
+	slab->free = pPixmap;
+	/* The last empty slab of a class is kept, against churn. */
+	if (--slab->used == 0 && scfbSlabRoom(fPtr, slab))
+		scfbSlabFree(fPtr, slab);
+	else if (slab->prev != NULL && (slab->used == 0 ||
+	    slab->used == scfbPoolChunks(slab->class) - 1)) {
+		/* Has room again. */
+		scfbSlabUnlink(fPtr, slab);
+		scfbSlabPush(fPtr, slab);
+	}
+	return TRUE;
+}
+
+/* After fbScreenInit, below the layers that wrap pixmap creation. */
+Bool
+ScfbPoolInit(ScreenPtr pScreen)
+{
+	ScfbPtr fPtr = SCFBPTR(xf86ScreenToScrn(pScreen));
+
+	if (!dixRegisterPrivateKey(scfbPoolKey, PRIVATE_PIXMAP,
+		sizeof(ScfbPoolPrivRec)))
+		return FALSE;
+	fPtr->CreatePixmap = pScreen->CreatePixmap;
+	pScreen->CreatePixmap = scfbPoolCreatePixmap;
+	fPtr->DestroyPixmap = pScreen->DestroyPixmap;
+	pScreen->DestroyPixmap = scfbPoolDestroyPixmap;
+	return TRUE;
+}
+
+/*
+ * Publish the pool counters as the _SCFB_PIXMAP_POOL property of the
+ * root window, at most once per statsInterval: pixmaps taken from the
+ * pool, left to fb for their size and for the cap, then kB in slabs, in
+ * chunks handed out and asked for by the pixmaps in them.
+ */
+void
+ScfbPoolPublish(ScrnInfoPtr pScrn)
+{
+	ScfbPtr fPtr = SCFBPTR(pScrn);
+	ScreenPtr pScreen = pScrn->pScreen;
+	CARD32 now = GetTimeInMillis(), value[6];
+	Atom atom;
+
+	if (fPtr->poolMax == 0 || pScreen->root == NULL ||
+	    now - fPtr->poolPublished < fPtr->statsInterval)
+		return;
+	fPtr->poolPublished = now;
+
+	value[0] = fPtr->statPoolAllocs;
+	value[1] = fPtr->statPoolLarge;
+	value[2] = fPtr->statPoolCapped;
+	value[3] = fPtr->poolBytes / 1024;
+	value[4] = fPtr->poolChunkBytes / 1024;
+	value[5] = fPtr->poolUsedBytes / 1024;
+	atom = MakeAtom(SCFB_POOL_PROPERTY, sizeof(SCFB_POOL_PROPERTY) - 1,
+	    TRUE);
+	dixChangeWindowProperty(serverClient, pScreen->root, atom, XA_INTEGER,
+	    32, PropModeReplace, 6, value, FALSE);
+}
+
+/* Once the screen is gone, with all of its pixmaps. */
+void
+ScfbPoolFini(ScrnInfoPtr pScrn)
+{
+	ScfbPtr fPtr = SCFBPTR(pScrn);
+	int class;
+
+	xf86DrvMsg(pScrn->scrnIndex, X_INFO, "Pixmap pool: %llu pixmaps, "
+	    "%llu left to fb for size, %llu for the %lu kB cap\n",
+	    (unsigned long long)fPtr->statPoolAllocs,
+	    (unsigned long long)fPtr->statPoolLarge,
+	    (unsigned long long)fPtr->statPoolCapped,
+	    (unsigned long)(fPtr->poolMax / 1024));
+	for (class = 0; class < SCFB_POOL_CLASSES; class++)
+		while (fPtr->poolSlabs[class] != NULL)
+			scfbSlabFree(fPtr, fPtr->poolSlabs[class]);
+	fPtr->poolChunkBytes = fPtr->poolUsedBytes = 0;
+}
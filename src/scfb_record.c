@@ -0,0 +1,351 @@
+/*
+ * Copyright © 2001-2012 Matthieu Herrb
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *    - Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    - Redistributions in binary form must reproduce the above
+ *      copyright notice, this list of conditions and the following
+ *      disclaimer in the documentation and/or other materials provided
+ *      with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ * ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/*
+ * Recording of the damage handed to each flush, and of the changed
+ * contents, for replaying the flush offline.  See scfb_record.h.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "xf86.h"
+
+#include "scfb.h"
+#include "scfb_record.h"
+
+#define SCFB_RECORD_TILE	32
+
+static void
+scfbRecordStop(ScrnInfoPtr pScrn, const char *what)
+{
+	ScfbPtr fPtr = SCFBPTR(pScrn);
+
+	xf86DrvMsg(pScrn->scrnIndex, X_ERROR, "%s %s: %s, recording stopped\n",
+	    what, fPtr->recordName, strerror(errno));
+	close(fPtr->recordFd);
+	fPtr->recordFd = -1;
+}
+
+static void
+scfbRecordWrite(ScrnInfoPtr pScrn, const void *buf, size_t len)
+{
+	ScfbPtr fPtr = SCFBPTR(pScrn);
+	const CARD8 *p = buf;
+	ssize_t n;
+
+	while (len > 0) {
+		n = write(fPtr->recordFd, p, len);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			scfbRecordStop(pScrn, "write");
+			return;
+		}
+		p += n;
+		len -= n;
+	}
+}
+
+/* Make room for len bytes in the record buffer. */
+static Bool
+scfbRecordReserve(ScfbPtr fPtr, size_t len)
+{
+	CARD8 *buf;
+
+	if (len <= fPtr->recordBufLen)
+		return TRUE;
+	buf = realloc(fPtr->recordBuf, len);
+	if (buf == NULL)
+		return FALSE;
+	fPtr->recordBuf = buf;
+	fPtr->recordBufLen = len;
+	return TRUE;
+}
+
+/* FNV-1a, a word at a time. */
+static uint64_t
+scfbRecordHash(const CARD8 *p, int pitch, int bytes, int rows)
+{
+	uint64_t h = 0xcbf29ce484222325ULL, w;
+	int i;
+
+	for (; rows > 0; rows--, p += pitch) {
+		for (i = 0; i + 8 <= bytes; i += 8) {
+			memcpy(&w, p + i, 8);
+			h = (h ^ w) * 0x100000001b3ULL;
+		}
+		for (; i < bytes; i++)
+			h = (h ^ p[i]) * 0x100000001b3ULL;
+	}
+	return h;
+}
+
+Bool
+ScfbRecordInit(ScrnInfoPtr pScrn)
+{
+	ScfbPtr fPtr = SCFBPTR(pScrn);
+	scfb_record_header hdr;
+
+	fPtr->recordFd = open(fPtr->recordName,
+	    O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (fPtr->recordFd == -1) {
+		xf86DrvMsg(pScrn->scrnIndex, X_ERROR, "open %s: %s\n",
+		    fPtr->recordName, strerror(errno));
+		return FALSE;
+	}
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = SCFB_RECORD_MAGIC;
+	hdr.version = SCFB_RECORD_VERSION;
+	hdr.flags = fPtr->recordPixels ? SCFB_RECORD_PIXELS : 0;
+	hdr.tile_size = SCFB_RECORD_TILE;
+	hdr.bpp = pScrn->bitsPerPixel;
+	hdr.depth = pScrn->depth;
+	hdr.red_mask = pScrn->mask.red;
+	hdr.green_mask = pScrn->mask.green;
+	hdr.blue_mask = pScrn->mask.blue;
+	hdr.fb_width = fPtr->info.vi_width;
+	hdr.fb_height = fPtr->info.vi_height;
+	hdr.fb_bpp = fPtr->info.vi_depth;
+	hdr.fb_pitch = fPtr->linebytes;
+	hdr.scale = fPtr->scale;
+	scfbRecordWrite(pScrn, &hdr, sizeof(hdr));
+	if (fPtr->recordFd == -1)
+		return FALSE;
+
+	xf86DrvMsg(pScrn->scrnIndex, X_INFO, "Recording flushes to %s\n",
+	    fPtr->recordName);
+	return TRUE;
+}
+
+/* Record the mapping of the framebuffer to the shadow. */
+void
+ScfbRecordLayout(ScrnInfoPtr pScrn)
+{
+	ScfbPtr fPtr = SCFBPTR(pScrn);
+	ScfbXformPtr xf = &fPtr->xform;
+	struct {
+		scfb_record		rec;
+		scfb_record_layout	layout;
+	} r;
+
+	if (fPtr->recordFd == -1)
+		return;
+
+	memset(&r, 0, sizeof(r));
+	r.rec.type = SCFB_RECORD_LAYOUT;
+	r.rec.size = sizeof(r);
+	r.rec.usec = GetTimeInMicros();
+	r.layout.width = fPtr->shadowWidth;
+	r.layout.height = fPtr->shadowHeight;
+	r.layout.pitch = fPtr->shadowPitch;
+	r.layout.img_width = fPtr->imgWidth;
+	r.layout.img_height = fPtr->imgHeight;
+	r.layout.xx = xf->xx;
+	r.layout.xy = xf->xy;
+	r.layout.x0 = xf->x0;
+	r.layout.yx = xf->yx;
+	r.layout.yy = xf->yy;
+	r.layout.y0 = xf->y0;
+	scfbRecordWrite(pScrn, &r, sizeof(r));
+}
+
+/* Record the current shadow geometry; every tile counts as changed. */
+void
+ScfbRecordGeometry(ScrnInfoPtr pScrn)
+{
+	ScfbPtr fPtr = SCFBPTR(pScrn);
+
+	if (fPtr->recordFd == -1)
+		return;
+
+	free(fPtr->recordHash);
+	fPtr->recordTilesX = (fPtr->shadowWidth + SCFB_RECORD_TILE - 1) /
+	    SCFB_RECORD_TILE;
+	fPtr->recordTilesY = (fPtr->shadowHeight + SCFB_RECORD_TILE - 1) /
+	    SCFB_RECORD_TILE;
+	fPtr->recordHash = calloc((size_t)fPtr->recordTilesX *
+	    fPtr->recordTilesY, sizeof(CARD64));
+	if (fPtr->recordHash == NULL) {
+		errno = ENOMEM;
+		scfbRecordStop(pScrn, "tiles for");
+		return;
+	}
+	ScfbRecordLayout(pScrn);
+}
+
+/* Record the damage of one flush and the tiles it changed. */
+void
+ScfbRecordFlush(ScrnInfoPtr pScrn, RegionPtr pRegion)
+{
+	ScfbPtr fPtr = SCFBPTR(pScrn);
+	BoxPtr ext = RegionExtents(pRegion), pbox = RegionRects(pRegion);
+	int nbox = RegionNumRects(pRegion);
+	int cpp = pScrn->bitsPerPixel / 8, ts = SCFB_RECORD_TILE;
+	int tx, ty, tx1, ty1, tx2, ty2, y, i;
+	size_t len, bytes, tilelen;
+	scfb_record *rec;
+	scfb_record_box *rbox;
+	scfb_record_tile *tile;
+	CARD64 hash;
+	CARD8 *src, *p;
+	BoxRec b;
+
+	if (fPtr->recordFd == -1 || nbox == 0)
+		return;
+
+	tx1 = ext->x1 / ts;
+	ty1 = ext->y1 / ts;
+	tx2 = min((ext->x2 + ts - 1) / ts, fPtr->recordTilesX);
+	ty2 = min((ext->y2 + ts - 1) / ts, fPtr->recordTilesY);
+
+	/* Room for every tile of the extents. */
+	tilelen = sizeof(scfb_record_tile);
+	if (fPtr->recordPixels)
+		tilelen += ((size_t)ts * ts * cpp + 7) & ~7;
+	len = sizeof(scfb_record) + ((nbox * sizeof(scfb_record_box) + 7) & ~7)
+	    + (size_t)max(tx2 - tx1, 0) * max(ty2 - ty1, 0) * tilelen;
+	if (!scfbRecordReserve(fPtr, len))
+		return;
+
+	rec = (scfb_record *)fPtr->recordBuf;
+	memset(rec, 0, sizeof(*rec));
+	rec->type = SCFB_RECORD_FLUSH;
+	rec->usec = GetTimeInMicros();
+	rec->count = nbox;
+	rbox = (scfb_record_box *)(rec + 1);
+	for (i = 0; i < nbox; i++, pbox++, rbox++) {
+		rbox->x1 = pbox->x1;
+		rbox->y1 = pbox->y1;
+		rbox->x2 = pbox->x2;
+		rbox->y2 = pbox->y2;
+	}
+	len = sizeof(scfb_record) + ((nbox * sizeof(scfb_record_box) + 7) & ~7);
+	memset(rbox, 0, fPtr->recordBuf + len - (CARD8 *)rbox);
+
+	for (ty = ty1; ty < ty2; ty++) {
+		for (tx = tx1; tx < tx2; tx++) {
+			b.x1 = tx * ts;
+			b.y1 = ty * ts;
+			b.x2 = min(b.x1 + ts, fPtr->shadowWidth);
+			b.y2 = min(b.y1 + ts, fPtr->shadowHeight);
+			if (RegionContainsRect(pRegion, &b) == rgnOUT)
+				continue;
+
+			src = (CARD8 *)fPtr->shadow + b.y1 * fPtr->shadowPitch +
+			    b.x1 * cpp;
+			bytes = (b.x2 - b.x1) * cpp;
+			hash = scfbRecordHash(src, fPtr->shadowPitch, bytes,
+			    b.y2 - b.y1);
+			i = ty * fPtr->recordTilesX + tx;
+			if (fPtr->recordHash[i] == hash)
+				continue;
+			fPtr->recordHash[i] = hash;
+
+			tile = (scfb_record_tile *)(fPtr->recordBuf + len);
+			memset(tile, 0, sizeof(*tile));
+			tile->x = b.x1;
+			tile->y = b.y1;
+			tile->w = b.x2 - b.x1;
+			tile->h = b.y2 - b.y1;
+			tile->hash = hash;
+			len += sizeof(*tile);
+			rec->tiles++;
+			if (!fPtr->recordPixels)
+				continue;
+
+			p = fPtr->recordBuf + len;
+			for (y = b.y1; y < b.y2; y++, p += bytes,
+			    src += fPtr->shadowPitch)
+				memcpy(p, src, bytes);
+			bytes *= b.y2 - b.y1;
+			memset(p, 0, ((bytes + 7) & ~7) - bytes);
+			len += (bytes + 7) & ~7;
+		}
+	}
+
+	rec->size = len;
+	scfbRecordWrite(pScrn, fPtr->recordBuf, len);
+}
+
+/* Record one call telling the kernel of changed framebuffer boxes. */
+void
+ScfbRecordDirty(ScrnInfoPtr pScrn, const BoxRec *pbox, int nbox)
+{
+	ScfbPtr fPtr = SCFBPTR(pScrn);
+	scfb_record *rec;
+	scfb_record_box *rbox;
+	size_t len;
+	int i;
+
+	if (fPtr->recordFd == -1 || nbox == 0)
+		return;
+
+	len = sizeof(scfb_record) + ((nbox * sizeof(scfb_record_box) + 7) & ~7);
+	if (!scfbRecordReserve(fPtr, len))
+		return;
+	memset(fPtr->recordBuf, 0, len);
+	rec = (scfb_record *)fPtr->recordBuf;
+	rec->type = SCFB_RECORD_DIRTY;
+	rec->size = len;
+	rec->usec = GetTimeInMicros();
+	rec->count = nbox;
+	rbox = (scfb_record_box *)(rec + 1);
+	for (i = 0; i < nbox; i++, pbox++, rbox++) {
+		rbox->x1 = pbox->x1;
+		rbox->y1 = pbox->y1;
+		rbox->x2 = pbox->x2;
+		rbox->y2 = pbox->y2;
+	}
+	scfbRecordWrite(pScrn, fPtr->recordBuf, len);
+}
+
+void
+ScfbRecordFini(ScrnInfoPtr pScrn)
+{
+	ScfbPtr fPtr = SCFBPTR(pScrn);
+
+	if (fPtr->recordFd != -1) {
+		close(fPtr->recordFd);
+		fPtr->recordFd = -1;
+	}
+	free(fPtr->recordHash);
+	fPtr->recordHash = NULL;
+	free(fPtr->recordBuf);
+	fPtr->recordBuf = NULL;
+	fPtr->recordBufLen = 0;
+}
@@ -0,0 +1,121 @@
+/*
+ * Copyright © 2001-2012 Matthieu Herrb
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *    - Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    - Redistributions in binary form must reproduce the above
+ *      copyright notice, this list of conditions and the following
+ *      disclaimer in the documentation and/or other materials provided
+ *      with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ * ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+/*
+ * Format of the flush recordings written with Option "RecordFlush".
+ *
+ * A recording is a scfb_record_header followed by records, each a
+ * scfb_record and its payload, padded to a multiple of 8 bytes.  It can
+ * be read as a stream, or mapped and walked using the record sizes.
+ * Everything is in the byte order of the machine that wrote it.
+ *
+ * A SCFB_RECORD_LAYOUT record carries a scfb_record_layout: the first
+ * record is one, and another follows every rotation of the screen and
+ * every move of the viewport of a virtual screen.
+ *
+ * A SCFB_RECORD_FLUSH record describes one flush: count boxes of damage
+ * in shadow coordinates, as handed to the flush before coalescing, then
+ * tiles scfb_record_tile.  The shadow is cut into tile_size square tiles
+ * and a tile is listed when it is damaged and its contents no longer hash
+ * to the value it was last listed with.  When the header has
+ * SCFB_RECORD_PIXELS set, each tile is followed by its pixels, rows
+ * packed, padded to a multiple of 8 bytes.
+ *
+ * A SCFB_RECORD_DIRTY record stands for one call telling the kernel which
+ * framebuffer rectangles changed, made with Option "DirtyNotify": count
+ * boxes in framebuffer pixels.  The calls for a flush follow its
+ * SCFB_RECORD_FLUSH record.  Where the kernel has no such call, the
+ * recording takes the place of the device.
+ */
+
+#ifndef SCFB_RECORD_H
+#define SCFB_RECORD_H
+
+#include <stdint.h>
+
+#define SCFB_RECORD_MAGIC	0x52464353	/* "SCFR" */
+#define SCFB_RECORD_VERSION	2
+
+#define SCFB_RECORD_PIXELS	0x1		/* Header flag. */
+
+#define SCFB_RECORD_LAYOUT	1		/* Record types. */
+#define SCFB_RECORD_FLUSH	2
+#define SCFB_RECORD_DIRTY	3
+
+typedef struct {
+	uint32_t		magic;
+	uint32_t		version;
+	uint32_t		flags;
+	uint32_t		tile_size;
+	uint32_t		bpp; /* Shadow pixels. */
+	uint32_t		depth;
+	uint32_t		red_mask;
+	uint32_t		green_mask;
+	uint32_t		blue_mask;
+	uint32_t		fb_width; /* Framebuffer, for the conversion. */
+	uint32_t		fb_height;
+	uint32_t		fb_bpp;
+	uint32_t		fb_pitch;
+	uint32_t		scale; /* 16.16 */
+} scfb_record_header;
+
+typedef struct {
+	uint32_t		type;
+	uint32_t		size; /* Bytes, with the payload and padding. */
+	uint64_t		usec; /* Monotonic. */
+	uint32_t		count;
+	uint32_t		tiles;
+} scfb_record;
+
+/*
+ * Framebuffer pixel (u, v), before scaling, shows shadow pixel
+ * (xx * u + xy * v + x0, yx * u + yy * v + y0).
+ */
+typedef struct {
+	uint32_t		width; /* Shadow. */
+	uint32_t		height;
+	uint32_t		pitch;
+	uint32_t		img_width; /* Shown, in framebuffer orientation. */
+	uint32_t		img_height;
+	uint32_t		pad;
+	int32_t			xx, xy, x0;
+	int32_t			yx, yy, y0;
+} scfb_record_layout;
+
+typedef struct {
+	int16_t			x1, y1, x2, y2;
+} scfb_record_box;
+
+typedef struct {
+	uint16_t		x, y, w, h;
+	uint64_t		hash;
+} scfb_record_tile;
+
+#endif /* SCFB_RECORD_H */
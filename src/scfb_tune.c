@@ -0,0 +1,268 @@
+/*
+ * Copyright © 2001-2012 Matthieu Herrb
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *    - Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    - Redistributions in binary form must reproduce the above
+ *      copyright notice, this list of conditions and the following
+ *      disclaimer in the documentation and/or other materials provided
+ *      with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ * ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+
+/*
+ * Runtime tuning.  The knobs of the flush are published as INTEGER
+ * properties of the root window, for example
+ *	xprop -root -f _SCFB_FLUSH_BACKOFF 32i -set _SCFB_FLUSH_BACKOFF 50
+ * A new value is checked when it is stored and applied before the next
+ * flush, then the property is written back with the values in effect,
+ * so that rejected values do not linger.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <string.h>
+
+#include "xf86.h"
+#include "windowstr.h"
+#include "property.h"
+#include "propertyst.h"
+#include <X11/Xatom.h>
+
+#include "scfb.h"
+
+enum {
+	SCFB_TUNE_COALESCE,
+	SCFB_TUNE_COST,
+	SCFB_TUNE_BACKOFF,
+	SCFB_TUNE_THREAD,
+	SCFB_TUNE_STATS
+};
+
+static const struct {
+	const char *		name;
+	int			count;
+	INT32			min, max;
+	Bool			shadow; /* Not with ReadMirror. */
+} scfbKnobs[SCFB_TUNE_KNOBS] = {
+	{ "_SCFB_FLUSH_COALESCE", 1, 0, 1, FALSE },
+	/* Cost model: per box, per row and per byte, in picoseconds. */
+	{ "_SCFB_FLUSH_COST", 3, 0, 1000000000, FALSE },
+	{ "_SCFB_FLUSH_BACKOFF", 1, 0, 1000, TRUE },
+	{ "_SCFB_FLUSH_THREAD", 1, 0, 1, TRUE },
+	{ "_SCFB_STATS_INTERVAL", 1, 100, 3600000, FALSE }
+};
+
+static void
+scfbTuneCurrent(ScfbPtr fPtr, int k, INT32 *v)
+{
+	switch (k) {
+	case SCFB_TUNE_COALESCE:
+		v[0] = fPtr->coalesce;
+		break;
+	case SCFB_TUNE_COST:
+		v[0] = min(fPtr->costBox, scfbKnobs[k].max);
+		v[1] = min(fPtr->costRow, scfbKnobs[k].max);
+		v[2] = min(fPtr->costByte, scfbKnobs[k].max);
+		break;
+	case SCFB_TUNE_BACKOFF:
+		v[0] = fPtr->backoffMax;
+		break;
+	case SCFB_TUNE_THREAD:
+		v[0] = fPtr->flushRunning;
+		break;
+	case SCFB_TUNE_STATS:
+		v[0] = fPtr->statsInterval;
+		break;
+	}
+}
+
+static void
+scfbTunePublish(ScrnInfoPtr pScrn, int k)
+{
+	ScfbPtr fPtr = SCFBPTR(pScrn);
+	INT32 v[SCFB_TUNE_VALUES];
+
+	scfbTuneCurrent(fPtr, k, v);
+	dixChangeWindowProperty(serverClient, pScrn->pScreen->root,
+	    fPtr->tuneAtom[k], XA_INTEGER, 32, PropModeReplace,
+	    scfbKnobs[k].count, v, FALSE);
+}
+
+/* Check a value stored by a client, and keep it for the next flush. */
+static void
+scfbTuneChanged(CallbackListPtr *list, void *data, void *args)
+{
+	ScrnInfoPtr pScrn = data;
+	ScfbPtr fPtr = SCFBPTR(pScrn);
+	PropertyStateRec *rec = args;
+	PropertyPtr pProp = rec->prop;
+	const INT32 *v;
+	int k, i;
+
+	if (rec->win != pScrn->pScreen->root)
+		return;
+	for (k = 0; k < SCFB_TUNE_KNOBS; k++)
+		if (pProp->propertyName == fPtr->tuneAtom[k])
+			break;
+	if (k == SCFB_TUNE_KNOBS)
+		return;
+
+	/* Deleted or not, the property shows the values in effect. */
+	fPtr->tuneStale |= 1 << k;
+	if (rec->state != PropertyNewValue)
+		return;
+	if ((pProp->type != XA_INTEGER && pProp->type != XA_CARDINAL) ||
+	    pProp->format != 32 || pProp->size != scfbKnobs[k].count) {
+		xf86DrvMsg(pScrn->scrnIndex, X_WARNING,
+		    "%s: expected %d 32 bit integer%s, ignored\n",
+		    scfbKnobs[k].name, scfbKnobs[k].count,
+		    scfbKnobs[k].count == 1 ? "" : "s");
+		return;
+	}
+	if (scfbKnobs[k].shadow && !fPtr->shadowFB) {
+		xf86DrvMsg(pScrn->scrnIndex, X_WARNING,
+		    "%s: requires the shadow framebuffer, ignored\n",
+		    scfbKnobs[k].name);
+		return;
+	}
+	v = pProp->data;
+	for (i = 0; i < scfbKnobs[k].count; i++)
+		if (v[i] < scfbKnobs[k].min || v[i] > scfbKnobs[k].max) {
+			xf86DrvMsg(pScrn->scrnIndex, X_WARNING,
+			    "%s: %d is not within %d to %d, ignored\n",
+			    scfbKnobs[k].name, (int)v[i],
+			    (int)scfbKnobs[k].min, (int)scfbKnobs[k].max);
+			return;
+		}
+	for (i = 0; i < scfbKnobs[k].count; i++)
+		fPtr->tuneValue[k][i] = v[i];
+	fPtr->tunePending |= 1 << k;
+}
+
+static void
+scfbTuneSet(ScrnInfoPtr pScrn, int k, const INT32 *v)
+{
+	ScfbPtr fPtr = SCFBPTR(pScrn);
+
+	switch (k) {
+	case SCFB_TUNE_COALESCE:
+		fPtr->coalesce = v[0];
+		break;
+	case SCFB_TUNE_COST:
+		fPtr->costBox = v[0];
+		fPtr->costRow = v[1];
+		fPtr->costByte = v[2];
+		break;
+	case SCFB_TUNE_BACKOFF:
+		if (v[0] == fPtr->backoffMax)
+			break;
+		if (v[0] == 0) {
+			/* Let out what is held back first. */
+			ScfbFlushSync(pScrn);
+			ScfbBackoffStop(pScrn);
+			fPtr->backoffMax = 0;
+		} else if (fPtr->backoffMax == 0) {
+			fPtr->backoffMax = v[0];
+			ScfbBackoffStart(pScrn);
+		} else {
+			fPtr->backoffMax = v[0];
+			fPtr->backoff = min(fPtr->backoff, v[0]);
+		}
+		break;
+	case SCFB_TUNE_THREAD:
+		if (v[0] && !fPtr->flushRunning) {
+			fPtr->flushThreaded = TRUE;
+			ScfbFlushStart(pScrn);
+		} else if (!v[0] && fPtr->flushRunning) {
+			ScfbFlushStop(pScrn);
+			fPtr->flushThreaded = FALSE;
+		}
+		break;
+	case SCFB_TUNE_STATS:
+		fPtr->statsInterval = v[0];
+		break;
+	}
+}
+
+/* Called before each flush, from the main thread. */
+void
+ScfbTuneApply(ScrnInfoPtr pScrn)
+{
+	ScfbPtr fPtr = SCFBPTR(pScrn);
+	INT32 v[SCFB_TUNE_VALUES];
+	int k;
+
+	if ((fPtr->tunePending | fPtr->tuneStale) == 0 ||
+	    pScrn->pScreen->root == NULL)
+		return;
+
+	for (k = 0; k < SCFB_TUNE_KNOBS; k++) {
+		if (fPtr->tunePending & (1 << k)) {
+			scfbTuneSet(pScrn, k, fPtr->tuneValue[k]);
+			scfbTuneCurrent(fPtr, k, v);
+			if (scfbKnobs[k].count == 1)
+				xf86DrvMsg(pScrn->scrnIndex, X_INFO,
+				    "%s now %d\n", scfbKnobs[k].name,
+				    (int)v[0]);
+			else
+				xf86DrvMsg(pScrn->scrnIndex, X_INFO,
+				    "%s now %d %d %d\n", scfbKnobs[k].name,
+				    (int)v[0], (int)v[1], (int)v[2]);
+		}
+		if ((fPtr->tunePending | fPtr->tuneStale) & (1 << k))
+			scfbTunePublish(pScrn, k);
+	}
+	fPtr->tunePending = fPtr->tuneStale = 0;
+}
+
+void
+ScfbTuneInit(ScrnInfoPtr pScrn)
+{
+	ScfbPtr fPtr = SCFBPTR(pScrn);
+	int k;
+
+	for (k = 0; k < SCFB_TUNE_KNOBS; k++)
+		fPtr->tuneAtom[k] = MakeAtom(scfbKnobs[k].name,
+		    strlen(scfbKnobs[k].name), TRUE);
+	if (!AddCallback(&PropertyStateCallback, scfbTuneChanged, pScrn)) {
+		xf86DrvMsg(pScrn->scrnIndex, X_WARNING,
+		    "Cannot watch properties, runtime tuning disabled\n");
+		fPtr->tuning = FALSE;
+		return;
+	}
+	/* Published along with the first flush, once there is a root. */
+	fPtr->tunePending = 0;
+	fPtr->tuneStale = (1 << SCFB_TUNE_KNOBS) - 1;
+}
+
+void
+ScfbTuneFini(ScrnInfoPtr pScrn)
+{
+	ScfbPtr fPtr = SCFBPTR(pScrn);
+
+	if (!fPtr->tuning)
+		return;
+	DeleteCallback(&PropertyStateCallback, scfbTuneChanged, pScrn);
+}